@@ -22,21 +22,165 @@
  * SOFTWARE.
  * */
 
-float2 tile_to_cartesian(float2 pt, float4 trx, float4 try)
+#ifdef PROJECTION
+#include "projection.h"
+#endif
+
+// With -DBATCH, a single launch renders a batch of tiles into the layers of
+// an image array, get_global_id(2) being the tile. The transforms and the
+// ranges of the tiles are then passed as arrays, tiles[i] holding the first
+// range of the tile and their count. TILE_ARGS and TILE_SETUP hide the
+// difference, so the kernels see trx, try, nranges and ranges either way.
+// RANGE is an argument as well, so that a single build of the kernel serves
+// all the zoomlevels. refpt is where the first input point ended up after
+// the grid sorted the points, the reference of the tdoa kernel.
+#ifdef BATCH
+#define TILE_ARGS \
+		read_only global float8 *trxs, \
+		read_only global float8 *trys, \
+		read_only global uint2 *tiles, \
+		read_only global uint2 *allranges, \
+		float range, \
+		uint refpt
+#define TILE_SETUP \
+	float8 trx = trxs[get_global_id(2)]; \
+	float8 try = trys[get_global_id(2)]; \
+	uint nranges = tiles[get_global_id(2)].y; \
+	global uint2 *ranges = allranges + tiles[get_global_id(2)].x
+#define TILE_ID get_global_id(2)
+// Index of the first range of the tile in the ranges of the whole launch
+#define TILE_RANGES_BASE tiles[get_global_id(2)].x
+#define TILE_IMAGE image2d_array_t
+#define write_tile(out, x, y, cid) \
+	write_imageui(out, (int4)(x, y, get_global_id(2), 0), (uint4)(cid, 0, 0, 0))
+#else
+#define TILE_ARGS \
+		float8 trx, \
+		float8 try, \
+		uint nranges, \
+		read_only global uint2 *ranges, \
+		float range, \
+		uint refpt
+#define TILE_SETUP (void)0
+#define TILE_ID 0
+#define TILE_RANGES_BASE 0
+#define TILE_IMAGE image2d_t
+#define write_tile(out, x, y, cid) \
+	write_imageui(out, (int2)(x, y), (uint4)(cid, 0, 0, 0))
+#endif
+
+#undef RANGE
+#define RANGE range
+
+// The coefficients are of (u, v, 1, uv, u^2, v^2), the quadratic ones are
+// zero on the zoomlevels where an affine transform is precise enough
+float2 tile_to_fitted(float2 pt, float8 trx, float8 try)
 {
-	float4 at = (float4) (
+	float8 at = (float8) (
 		pt.x,
 		pt.y,
 		1.0,
+		pt.x * pt.y,
+		pt.x * pt.x,
+		pt.y * pt.y,
+		0.0,
 		0.0
 	);
 	float2 ret = (float2) (
-		dot(at, trx),
-		dot(at, try)
+		dot(at.lo, trx.lo) + dot(at.hi, trx.hi),
+		dot(at.lo, try.lo) + dot(at.hi, try.hi)
 	);
 	return ret;
 }
 
+#ifdef GREAT_CIRCLE
+// Mean radius of the Earth in meters
+#define EARTH_RADIUS 6371008.8f
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#define GC_REAL double
+#define GC_PI M_PI
+#else
+#define GC_REAL float
+#define GC_PI M_PI_F
+#endif
+
+// The pixels are (latitude, longitude) in radians, same as the points. The
+// tile is trx.s6, trx.s7 in a grid of try.s6 tiles, the coordinate in the
+// grid is computed in doubles if the device has them, as floats run out of
+// precision on the high zoomlevels.
+float2 tile_to_wgs84(float2 pt, float8 trx, float8 try)
+{
+	GC_REAL gx = ((GC_REAL)trx.s6 + pt.x) / try.s6;
+	GC_REAL gy = ((GC_REAL)trx.s7 + pt.y) / try.s6;
+	return (float2) (
+		(float)atan(sinh(GC_PI - 2 * GC_PI * gy)),
+		(float)(2 * GC_PI * gx - GC_PI)
+	);
+}
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : disable
+#endif
+
+float point_cos(float2 pt)
+{
+	return cos(pt.x);
+}
+
+// Great circle distance by the haversine formula, cosa and cosb are the
+// cosines of the latitudes of a and b from point_cos
+float point_distance(float2 a, float cosa, float2 b, float cosb)
+{
+	float2 s = sin((a - b) * 0.5f);
+	float h = s.x * s.x + cosa * cosb * s.y * s.y;
+	return 2.0f * EARTH_RADIUS * asin(min(sqrt(h), 1.0f));
+}
+
+float point_distance2(float2 a, float cosa, float2 b, float cosb)
+{
+	float d = point_distance(a, cosa, b, cosb);
+	return d * d;
+}
+#else
+// The projected coordinates are planar, the cosines are only there so the
+// kernels do not have to care which distance they use
+float point_cos(float2 pt)
+{
+	return 1.0f;
+}
+
+float point_distance(float2 a, float cosa, float2 b, float cosb)
+{
+	return distance(a, b);
+}
+
+float point_distance2(float2 a, float cosa, float2 b, float cosb)
+{
+	float2 d = a - b;
+	return dot(d, d);
+}
+#endif
+
+float2 tile_to_cartesian(float2 pt, float8 trx, float8 try)
+{
+#if defined(GREAT_CIRCLE)
+	return tile_to_wgs84(pt, trx, try);
+#elif defined(PROJECTION)
+	return tile_to_projected(pt, trx, try);
+#else
+	return tile_to_fitted(pt, trx, try);
+#endif
+}
+
+
+// See QGIS/src/plugins/heatmap/heatmap.cpp
+float quartic_kernel(float dist, float bw)
+{
+	dist = clamp((float)(dist / bw), -0.9999f, 0.9999f);
+	return 15.0 / 16.0 * pow(1 - dist, 2);
+}
 
 bool in_bounding_box(float2 in, float4 box)
 {
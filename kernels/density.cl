@@ -0,0 +1,140 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+// Additive (density) heatmap, every point adds its quartic footprint within
+// RANGE to the pixels around it instead of the pixels averaging the points.
+// The points are splatted by splat_points first, generate_pixel then only
+// maps the sums to colors. The sums are in units of the point values, so MIN
+// and MAX work the same way as with the heat kernel.
+
+#include "common.h"
+
+#ifdef GREAT_CIRCLE
+#error "The density kernel splats in projected meters, it has no great circle variant"
+#endif
+
+// Float atomics are not in OpenCL 1.2, so the sum is updated with a
+// compare-and-swap on its bits
+void atomic_add_float(volatile global float *addr, float val)
+{
+	union {
+		uint u;
+		float f;
+	} old, sum;
+	do {
+		old.f = *addr;
+		sum.f = old.f + val;
+	} while (atomic_cmpxchg((volatile global uint *)addr, old.u, sum.u) != old.u);
+}
+
+// Each work-item splats one point of the tile. The k-th point is found by a
+// binary search of ends, which holds the number of points of the tile up to
+// and including each of its ranges.
+__kernel void splat_points(
+		TILE_ARGS,
+		read_only global float2 *pts,
+		read_only global float *vals,
+		global float *accum,
+		read_only global uint *ends)
+{
+	TILE_SETUP;
+	uint k = get_global_id(0);
+	ends += TILE_RANGES_BASE;
+	// A batch is launched for the tile with the most points
+	if (nranges == 0 || k >= ends[nranges - 1]) {
+		return;
+	}
+	uint r = 0;
+	for (uint hi = nranges - 1; r < hi; ) {
+		uint mid = (r + hi) / 2;
+		if (ends[mid] > k) {
+			hi = mid;
+		} else {
+			r = mid + 1;
+		}
+	}
+	uint i = ranges[r].y - (ends[r] - k);
+	accum += TILE_ID * TILE_SIZE * TILE_SIZE;
+
+	// Inverse of the affine part of the tile to cartesian transform, to find
+	// the pixels around a point
+	float det = trx.s0 * try.s1 - trx.s1 * try.s0;
+	float2 inv0 = (float2)(try.s1, -trx.s1) / det;
+	float2 inv1 = (float2)(-try.s0, trx.s0) / det;
+	// The quadratic terms move the pixels by at most this much within the tile
+	float2 reach = (float2)(fabs(trx.s3) + fabs(trx.s4) + fabs(trx.s5),
+							fabs(try.s3) + fabs(try.s4) + fabs(try.s5)) + RANGE;
+#ifdef PROJECTION
+	// The pixels come from the exact projection, which the fitted transform
+	// the box is computed from only approximates
+	float slack = 0.0;
+	for (int k = 0; k < 9; k++) {
+		float2 at = (float2)(k % 3, k / 3) * 0.5f;
+		slack = max(slack, length(tile_to_projected(at, trx, try) -
+								  tile_to_fitted(at, trx, try)));
+	}
+	reach += 2.0f * slack;
+#endif
+	// Half of the footprint bounding box in pixels
+	float2 half = (float2)(dot(fabs(inv0), reach), dot(fabs(inv1), reach)) * TILE_SIZE;
+
+	float2 rel = pts[i] - (float2)(trx.s2, try.s2);
+	float2 center = (float2)(dot(inv0, rel), dot(inv1, rel)) * TILE_SIZE;
+	int2 lo = max(convert_int2_sat_rtn(center - half), 0);
+	int2 hi = min(convert_int2_sat_rtp(center + half), TILE_SIZE - 1);
+	for (int y = lo.y; y <= hi.y; y++) {
+		for (int x = lo.x; x <= hi.x; x++) {
+			float2 self = tile_to_cartesian((float2)((float)x / TILE_SIZE,
+													 (float)y / TILE_SIZE),
+											trx, try);
+			float2 d = self - pts[i];
+			float dist = dot(d, d);
+			if (dist < RANGE * RANGE) {
+				atomic_add_float(&accum[y * TILE_SIZE + x],
+								 vals[i] * quartic_kernel(dist, RANGE * RANGE));
+			}
+		}
+	}
+}
+
+__kernel void generate_pixel(
+		TILE_ARGS,
+		read_only global float2 *pts,
+		read_only global float *vals,
+		write_only TILE_IMAGE out,
+		read_only global float *accum)
+{
+	TILE_SETUP;
+	uint x = get_global_id(0);
+	uint y = get_global_id(1);
+
+	float density = accum[(TILE_ID * TILE_SIZE + y) * TILE_SIZE + x];
+	int cid = 0;
+	if (density > 0.0) {
+		float rval = (density - MIN) / MAX;
+		cid = clamp((int)(rval * COLORS_LEN), 1, COLORS_LEN - 1);
+	}
+
+	write_tile(out, x, y, cid);
+}
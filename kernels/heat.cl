@@ -24,38 +24,63 @@
 
 #include "common.h"
 
-// See QGIS/src/plugins/heatmap/heatmap.cpp
-float quartic_kernel(float dist, float bw)
-{
-	dist = clamp((float)(dist / bw), -0.9999f, 0.9999f);
-	return 15.0 / 16.0 * pow(1 - dist, 2);
-}
+// Number of points the work-group holds in local memory at a time
+#ifndef POINTS_CHUNK
+#define POINTS_CHUNK 256
+#endif
+
+#ifndef SUBTILE_SIZE
+#define SUBTILE_SIZE TILE_SIZE
+#endif
 
 __kernel void generate_pixel(
-		float4 trx,
-		float4 try,
-		uint npts,
+		TILE_ARGS,
 		read_only global float2 *pts,
 		read_only global float *vals,
-		write_only image2d_t out)
+		write_only TILE_IMAGE out)
 {
+	TILE_SETUP;
 	uint x = get_global_id(0);
 	uint y = get_global_id(1);
 
 	float2 self = tile_to_cartesian((float2)((float)x / TILE_SIZE, (float)y / TILE_SIZE),
 								  trx, try);
+	float selfcos = point_cos(self);
 
 	float val = 0.0;
 	float sw = 0.0;
 	float best = FLT_MAX;
-	for (uint i = 0; i < npts; i++) {
-		float dist = pow(self.x - pts[i].x, 2) + pow(self.y - pts[i].y, 2);
-		float w = quartic_kernel(dist, RANGE * RANGE);
-		if (dist < best) {
-			best = dist;
+
+	// The whole work-group goes through the same points, so it loads them
+	// into local memory a chunk at a time, each work-item a part of it
+	local float2 lpts[POINTS_CHUNK];
+	local float lvals[POINTS_CHUNK];
+	local float lcos[POINTS_CHUNK];
+	uint lid = get_local_id(1) * get_local_size(0) + get_local_id(0);
+	uint lsize = get_local_size(0) * get_local_size(1);
+
+	for (uint r = 0; r < nranges; r++) {
+		for (uint base = ranges[r].x; base < ranges[r].y; base += POINTS_CHUNK) {
+			uint n = min((uint)POINTS_CHUNK, ranges[r].y - base);
+			for (uint i = lid; i < n; i += lsize) {
+				lpts[i] = pts[base + i];
+				lvals[i] = vals[base + i];
+				lcos[i] = point_cos(lpts[i]);
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+
+			for (uint i = 0; i < n; i++) {
+				float dist = point_distance2(self, selfcos, lpts[i], lcos[i]);
+				float w = quartic_kernel(dist, RANGE * RANGE);
+				if (dist < best) {
+					best = dist;
+				}
+				sw += w;
+				val += lvals[i] * w;
+			}
+			// Everyone has to be done with the chunk before it gets replaced
+			barrier(CLK_LOCAL_MEM_FENCE);
 		}
-		sw += w;
-		val += vals[i] * w;
 	}
 	int cid = 0;
 	if (best < RANGE * RANGE && sw > 0.0) {
@@ -65,10 +90,13 @@ __kernel void generate_pixel(
 	}
 
 #ifdef HIGHLIGHT_BORDERS
-	if (x == 0 || y == 0 || x == TILE_SIZE - 1 || y == TILE_SIZE - 1) {
+	// A metatile is sliced into SUBTILE_SIZE tiles afterwards
+	uint sx = x % SUBTILE_SIZE;
+	uint sy = y % SUBTILE_SIZE;
+	if (sx == 0 || sy == 0 || sx == SUBTILE_SIZE - 1 || sy == SUBTILE_SIZE - 1) {
 		cid = 150;
 	}
 #endif
 
-	write_imageui(out, (int2)(x, y), (uint4)(cid, 0, 0, 0));
+	write_tile(out, x, y, cid);
 }
@@ -0,0 +1,92 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+// Exact Transverse Mercator and Mercator projections on the device, compiled
+// in with -DPROJECTION and the PROJ_* definitions from src/projection.c. The
+// projected coordinates need more than single precision before they get
+// rounded to floats, the host only picks this path for devices with doubles.
+
+#define PROJECTION_TMERC 1
+#define PROJECTION_MERC 2
+
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+// Projected coordinates from the isometric latitude of the sphere, which the
+// tile coordinates give directly, and the longitude from PROJ_LON0
+float2 project_isometric(double psi, double lam)
+{
+	lam = remainder(lam, 2.0 * M_PI);
+	// Isometric latitude of the ellipsoid
+	double q = psi - PROJ_E * atanh(PROJ_E * tanh(psi));
+#if PROJECTION == PROJECTION_TMERC
+	// The Krueger series, see Karney (2011), with the multiple angles from
+	// the angle addition formulas
+	const double alpha[6] = {
+		PROJ_ALPHA1, PROJ_ALPHA2, PROJ_ALPHA3, PROJ_ALPHA4, PROJ_ALPHA5, PROJ_ALPHA6
+	};
+	double t = sinh(q);
+	double xi = atan2(t, cos(lam));
+	double eta = atanh(sin(lam) / sqrt(1.0 + t * t));
+	double s2 = sin(2.0 * xi);
+	double c2 = cos(2.0 * xi);
+	double sh2 = sinh(2.0 * eta);
+	double ch2 = cosh(2.0 * eta);
+	double s = s2, c = c2, sh = sh2, ch = ch2;
+	double x = eta;
+	double y = xi;
+	for (int j = 0; j < 6; j++) {
+		y += alpha[j] * s * ch;
+		x += alpha[j] * c * sh;
+		double ns = s * c2 + c * s2;
+		c = c * c2 - s * s2;
+		s = ns;
+		double nsh = sh * ch2 + ch * sh2;
+		ch = ch * ch2 + sh * sh2;
+		sh = nsh;
+	}
+#else
+	double x = lam;
+	double y = q;
+#endif
+	return (float2)(PROJ_X0 + PROJ_KA * x, PROJ_Y0 + PROJ_KA * y);
+}
+
+// The WGS84 point is (latitude, longitude) in degrees, as in the input
+float2 wgs84_to_projected(float2 wgs)
+{
+	return project_isometric(atanh(sin(radians((double)wgs.x))),
+							 radians((double)wgs.y) - PROJ_LON0);
+}
+
+// With the projection on the device, the host puts the top left tile of the
+// metatile into trx.s6 and trx.s7, and the number of tiles of its zoomlevel
+// into try.s6. The fitted coefficients are still there for the bounding boxes.
+float2 tile_to_projected(float2 pt, float8 trx, float8 try)
+{
+	double gx = ((double)trx.s6 + pt.x) / try.s6;
+	double gy = ((double)trx.s7 + pt.y) / try.s6;
+	return project_isometric(M_PI - 2.0 * M_PI * gy, 2.0 * M_PI * gx - M_PI - PROJ_LON0);
+}
+
+#pragma OPENCL EXTENSION cl_khr_fp64 : disable
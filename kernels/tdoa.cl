@@ -25,30 +25,38 @@
 #include "common.h"
 
 __kernel void generate_pixel(
-		float4 trx,
-		float4 try,
-		uint npts,
+		TILE_ARGS,
 		read_only global float2 *pts,
 		read_only global float *vals,
-		write_only image2d_t out)
+		write_only TILE_IMAGE out)
 {
+	TILE_SETUP;
 	uint x = get_global_id(0);
 	uint y = get_global_id(1);
 
 	float2 self = tile_to_cartesian((float2)((float)x / TILE_SIZE,
 											 (float)y / TILE_SIZE),
 									trx, try);
+	float selfcos = point_cos(self);
 
-	float dist = distance(self, pts[0]);
+	// The first input point is the reference the time differences are
+	// relative to, whether or not it is among the points of the tile
+	uint ref = refpt;
+	float dist = point_distance(self, selfcos, pts[ref], point_cos(pts[ref]));
 	float err = 0;
-	for (uint i = 1; i < npts; i++) {
-		float dist2 = distance(self, pts[i]);
-		float ad = (dist - dist2) - vals[i];
-		ad = pow(ad, 2);
-		err += ad;
+	for (uint r = 0; r < nranges; r++) {
+		for (uint i = ranges[r].x; i < ranges[r].y; i++) {
+			if (i == ref) {
+				continue;
+			}
+			float dist2 = point_distance(self, selfcos, pts[i], point_cos(pts[i]));
+			float ad = (dist - dist2) - vals[i];
+			ad = pow(ad, 2);
+			err += ad;
+		}
 	}
 	err = sqrt(err);
 	err /= SCALE_BY;
 	int cid = COLORS_LEN - clamp((int)(err * COLORS_LEN), 0, COLORS_LEN - 1) - 1;
-	write_imageui(out, (int2)(x, y), (uint4)(cid, 0, 0, 0));
+	write_tile(out, x, y, cid);
 }
@@ -0,0 +1,273 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "colormaps.h"
+#include "log.h"
+#include "utils.h"
+
+#include "approx.h"
+
+// Sums of the kernel weights below this mean there is no point within RANGE
+#define APPROX_EPS 1e-6
+
+int approx_kernel_init(struct approx_kernel *krn, const char *name,
+					   const char *compargs, int tile_size)
+{
+	// Matched the same way as in cpu_kernel_init
+	const char *base = strrchr(name, '/');
+	base = base != NULL ? base + 1 : name;
+	size_t baselen = strends(base, ".cl") ? strlen(base) - 3 : strlen(base);
+	bool heat = baselen == strlen("heat") && !strncmp(base, "heat", baselen);
+	bool density = baselen == strlen("density") && !strncmp(base, "density", baselen);
+	if (!heat && !density) {
+		log_error("The approximation only supports the heat and density kernels");
+		return -1;
+	}
+	krn->additive = density;
+
+	// The buffers stay allocated across the zoomlevels
+	return cpu_kernel_init(&krn->exact, name, compargs, tile_size);
+}
+
+void approx_kernel_free(struct approx_kernel *krn)
+{
+	free(krn->grid);
+	free(krn->spectrum);
+	free(krn->line);
+	krn->grid = NULL;
+	krn->spectrum = NULL;
+	krn->line = NULL;
+	krn->gridside = 0;
+}
+
+static int ensure_buffers(struct approx_kernel *krn, size_t side)
+{
+	if (krn->gridside == side) {
+		return 0;
+	}
+	approx_kernel_free(krn);
+	krn->grid = malloc(side * side * sizeof(krn->grid[0]));
+	krn->spectrum = malloc(side * side * sizeof(krn->spectrum[0]));
+	krn->line = malloc(side * sizeof(krn->line[0]));
+	if (krn->grid == NULL || krn->spectrum == NULL || krn->line == NULL) {
+		approx_kernel_free(krn);
+		return -1;
+	}
+	krn->gridside = side;
+	return 0;
+}
+
+// In-place iterative radix-2 FFT, n has to be a power of two. Neither
+// direction is normalized.
+static void fft(double complex *data, size_t n, bool inverse)
+{
+	for (size_t i = 1, j = 0; i < n; i++) {
+		size_t bit = n >> 1;
+		for (; j & bit; bit >>= 1) {
+			j ^= bit;
+		}
+		j ^= bit;
+		if (i < j) {
+			double complex tmp = data[i];
+			data[i] = data[j];
+			data[j] = tmp;
+		}
+	}
+
+	for (size_t len = 2; len <= n; len <<= 1) {
+		double complex wlen = cexp((inverse ? 2.0 : -2.0) * M_PI * I / len);
+		for (size_t i = 0; i < n; i += len) {
+			double complex w = 1.0;
+			for (size_t j = 0; j < len / 2; j++) {
+				double complex u = data[i + j];
+				double complex v = data[i + j + len / 2] * w;
+				data[i + j] = u + v;
+				data[i + j + len / 2] = u - v;
+				w *= wlen;
+			}
+		}
+	}
+}
+
+static void fft2(struct approx_kernel *krn, bool inverse)
+{
+	size_t n = krn->gridside;
+	for (size_t y = 0; y < n; y++) {
+		fft(&krn->grid[y * n], n, inverse);
+	}
+	for (size_t x = 0; x < n; x++) {
+		for (size_t y = 0; y < n; y++) {
+			krn->line[y] = krn->grid[y * n + x];
+		}
+		fft(krn->line, n, inverse);
+		for (size_t y = 0; y < n; y++) {
+			krn->grid[y * n + x] = krn->line[y];
+		}
+	}
+}
+
+static double cic_response(size_t k, size_t n)
+{
+	double f = M_PI * (k < n / 2 ? (double)k : (double)k - n) / n;
+	double sinc = f == 0.0 ? 1.0 : sin(f) / f;
+	return sinc * sinc;
+}
+
+static uint8_t value_color(const struct cpu_kernel *exact, double val)
+{
+	double rval = (val - exact->min) / exact->max;
+	return clamp(rval * COLORMAP_LEN, 1.0, COLORMAP_LEN - 1.0);
+}
+
+void approx_render_tile(struct approx_kernel *krn, const cl_float8 *tr,
+						cl_uint nranges, const cl_uint2 *ranges,
+						const cl_float2 *pts, const float *vals, uint8_t *out)
+{
+	const struct cpu_kernel *exact = &krn->exact;
+	int tsize = exact->tile_size;
+	double range2 = (double)exact->range * exact->range;
+	// Bins to tile coordinates and their inverse, the kernel is isotropic in
+	// the cartesian coordinates, but not necessarily in the tile ones
+	double binsize = 1.0 / (tsize * APPROX_SUBDIV);
+	// The kernel footprint uses the affine part of the transform only
+	double a00 = tr[0].s[0], a01 = tr[0].s[1];
+	double a10 = tr[1].s[0], a11 = tr[1].s[1];
+	double det = a00 * a11 - a01 * a10;
+	if (!isfinite(det) || det == 0.0) {
+		exact->render(exact, tr, nranges, ranges, pts, vals, out);
+		return;
+	}
+	double inv00 = a11 / det, inv01 = -a01 / det;
+	double inv10 = -a10 / det, inv11 = a00 / det;
+	// Half of the footprint bounding box in bins
+	double hbins = ceil(fmax(fabs(inv00) + fabs(inv01), fabs(inv10) + fabs(inv11)) *
+						exact->range / binsize);
+	if (!(hbins <= APPROX_MAX_GRID)) {
+		exact->render(exact, tr, nranges, ranges, pts, vals, out);
+		return;
+	}
+	size_t margin = hbins;
+
+	size_t used = (size_t)tsize * APPROX_SUBDIV + 2 * margin;
+	size_t side = 1;
+	while (side < used) {
+		side *= 2;
+	}
+	if (side > APPROX_MAX_GRID || ensure_buffers(krn, side)) {
+		exact->render(exact, tr, nranges, ranges, pts, vals, out);
+		return;
+	}
+	size_t n = side;
+
+	// Spectrum of the kernel. The kernel is symmetric, so its spectrum is real.
+	memset(krn->grid, 0, n * n * sizeof(krn->grid[0]));
+	for (long dy = -(long)margin; dy <= (long)margin; dy++) {
+		for (long dx = -(long)margin; dx <= (long)margin; dx++) {
+			double mx = (a00 * dx + a01 * dy) * binsize;
+			double my = (a10 * dx + a11 * dy) * binsize;
+			double dist = mx * mx + my * my;
+			if (dist >= range2) {
+				continue;
+			}
+			double omt = 1.0 - dist / range2;
+			krn->grid[((dy + n) % n) * n + (dx + n) % n] = 15.0 / 16.0 * omt * omt;
+		}
+	}
+	fft2(krn, false);
+	// Also undoes the smoothing by the cloud in cell binning below, whose
+	// transfer function is sinc^2 along each axis
+	for (size_t y = 0; y < n; y++) {
+		double wy = cic_response(y, n);
+		for (size_t x = 0; x < n; x++) {
+			krn->spectrum[y * n + x] = creal(krn->grid[y * n + x]) / (wy * cic_response(x, n));
+		}
+	}
+
+	// Value sums go to the real part, counts to the imaginary part, so one
+	// transform convolves both. Each point is split between the four nearest
+	// bins (cloud in cell), which is much more precise than snapping it to the
+	// nearest one.
+	memset(krn->grid, 0, n * n * sizeof(krn->grid[0]));
+	for (cl_uint r = 0; r < nranges; r++) {
+		for (cl_uint i = ranges[r].x; i < ranges[r].y; i++) {
+			double rx = pts[i].x - tr[0].s[2];
+			double ry = pts[i].y - tr[1].s[2];
+			double u = inv00 * rx + inv01 * ry;
+			double v = inv10 * rx + inv11 * ry;
+			// A single step takes care of the quadratic terms, if there are
+			// any, they are small compared to the affine ones
+			double qx = tr[0].s[3] * u * v + tr[0].s[4] * u * u + tr[0].s[5] * v * v;
+			double qy = tr[1].s[3] * u * v + tr[1].s[4] * u * u + tr[1].s[5] * v * v;
+			double bx = (u - inv00 * qx - inv01 * qy) / binsize + margin;
+			double by = (v - inv10 * qx - inv11 * qy) / binsize + margin;
+			if (!(bx >= 0.0 && by >= 0.0 && bx < used - 1 && by < used - 1)) {
+				continue;
+			}
+			size_t ix = bx;
+			size_t iy = by;
+			double fx = bx - ix;
+			double fy = by - iy;
+			double complex pt = vals[i] + I;
+			double complex *bin = &krn->grid[iy * n + ix];
+			bin[0] += pt * (1.0 - fx) * (1.0 - fy);
+			bin[1] += pt * fx * (1.0 - fy);
+			bin[n] += pt * (1.0 - fx) * fy;
+			bin[n + 1] += pt * fx * fy;
+		}
+	}
+	fft2(krn, false);
+	for (size_t i = 0; i < n * n; i++) {
+		krn->grid[i] *= krn->spectrum[i];
+	}
+	fft2(krn, true);
+
+	// Pixels sit exactly on every APPROX_SUBDIV-th bin
+	double norm = 1.0 / ((double)n * n);
+	for (int y = 0; y < tsize; y++) {
+		for (int x = 0; x < tsize; x++) {
+			size_t bin = (y * APPROX_SUBDIV + margin) * n + x * APPROX_SUBDIV + margin;
+			double sum = creal(krn->grid[bin]) * norm;
+			double weight = cimag(krn->grid[bin]) * norm;
+			uint8_t cid = 0;
+			if (krn->additive) {
+				if (sum > APPROX_EPS) {
+					cid = value_color(exact, sum);
+				}
+			} else if (weight > APPROX_EPS) {
+				cid = value_color(exact, sum / weight);
+			}
+			// The borders of the output tiles, not just of the metatile
+			int sub = exact->subtile_size;
+			if (exact->highlight_borders && (x % sub == 0 || y % sub == 0 ||
+					x % sub == sub - 1 || y % sub == sub - 1)) {
+				cid = 150;
+			}
+			out[y * tsize + x] = cid;
+		}
+	}
+}
@@ -0,0 +1,63 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#ifndef APPROX_H
+#define APPROX_H
+
+#include <complex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <CL/cl.h>
+
+#include "cpu.h"
+
+// Bins per pixel side the points are snapped to
+#define APPROX_SUBDIV 2
+// Larger footprints fall back to the exact kernel, which is cheap there anyway
+// as few points fit into such tiles. Bounds the scratch space of each thread
+// to 24MB, the FFT needs doubles to tell the empty pixels apart.
+#define APPROX_MAX_GRID 1024
+
+// Approximation of the heat (weighted average) and density (additive)
+// kernels. The points are binned into a sub-pixel grid of value sums and
+// counts, which is then convolved with the quartic kernel through an FFT,
+// so the cost per tile does not depend on the number of points.
+struct approx_kernel {
+	struct cpu_kernel exact;
+	bool additive;
+	// Scratch space of the last tile, grown as needed
+	size_t gridside;
+	double complex *grid;
+	double *spectrum;
+	double complex *line;
+};
+
+int approx_kernel_init(struct approx_kernel *krn, const char *name,
+					   const char *compargs, int tile_size);
+void approx_render_tile(struct approx_kernel *krn, const cl_float8 *tr,
+						cl_uint nranges, const cl_uint2 *ranges,
+						const cl_float2 *pts, const float *vals, uint8_t *out);
+void approx_kernel_free(struct approx_kernel *krn);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#include <argp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <proj_api.h>
+
+#include "coords.h"
+#include "points.h"
+#include "utils.h"
+#include "log.h"
+
+struct arguments {
+	char *inpath;
+	char *outpath;
+	struct rect bounds;
+	bool bounds_defined;
+	projPJ proj_meters;
+};
+
+const char *argp_program_version = "cl-heatmap-convert 1.0";
+const char *argp_program_bug_address = "<atx@atx.name>";
+static const char argp_doc[] = "Converts JSON or Safecast CSV input to the binary point format";
+
+static struct argp_option argp_opts[] = {
+	{ "input",		'i',	"INPUT",		0,	"Input JSON or Safecast CSV", 0 },
+	{ "output",		'o',	"OUTPUT",		0,	"Output point file", 0 },
+	{ "boundaries",	'b',	"BOUNDARIES",	0,	"Only keep points inside '50.12,14.23,51.23,15.33'", 0 },
+	{ "projection",	'p',	"PROJECTION",	0,	"Also store the points in this Proj4 projection", 0 },
+	{ NULL,			0,		NULL,			0,	NULL, 0 }
+};
+
+static void parse_opt_boundaries(char *arg, struct argp_state *state)
+{
+	struct arguments *arguments = state->input;
+	float flts[4];
+	char *save;
+	char *end;
+
+	for (size_t i = 0; i < ARRAY_SIZE(flts); i++, arg = NULL) {
+		char *tok = strtok_r(arg, ",", &save);
+		if (tok == NULL) {
+			argp_error(state, "Error while parsing boundary specification!");
+			return;
+		}
+		flts[i] = strtof(tok, &end);
+		if (*end != '\0') {
+			argp_error(state, "Error while parsing boundary specification!");
+			return;
+		}
+	}
+
+	arguments->bounds = rect_make((cl_float2){ .x = flts[0], .y = flts[1] },
+								  (cl_float2){ .x = flts[2], .y = flts[3] });
+	arguments->bounds_defined = true;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct arguments *arguments = state->input;
+	switch (key) {
+		case 'i':
+			arguments->inpath = arg;
+			break;
+		case 'o':
+			arguments->outpath = arg;
+			break;
+		case 'b':
+			parse_opt_boundaries(arg, state);
+			break;
+		case 'p':
+			arguments->proj_meters = pj_init_plus(arg);
+			if (arguments->proj_meters == NULL) {
+				argp_error(state, "Failed to initialize projection: %s", pj_strerrno(pj_errno));
+			}
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp argp = { argp_opts, parse_opt, NULL, argp_doc, NULL, NULL, NULL };
+
+int main(int argc, char *argv[])
+{
+	struct arguments args = {
+		.inpath = NULL,
+		.outpath = NULL,
+		.bounds_defined = false,
+		.proj_meters = NULL,
+	};
+
+	argp_parse(&argp, argc, argv, 0, 0, &args);
+
+	if (args.inpath == NULL || args.outpath == NULL) {
+		fprintf(stderr, "Both input and output have to be specified!\n");
+		return EXIT_FAILURE;
+	}
+
+	init_projs();
+
+	struct stat src;
+	if (stat(args.inpath, &src)) {
+		log_error_errno("Failed to stat %s", args.inpath);
+		return EXIT_FAILURE;
+	}
+
+	struct points points;
+	int ret = strends(args.inpath, ".csv") ?
+		points_load_csv(args.inpath, &points) :
+		points_load_json(args.inpath, &points);
+	if (ret) {
+		return EXIT_FAILURE;
+	}
+	log_info("Loaded %zu points from %s", points.len, args.inpath);
+
+	if (args.bounds_defined) {
+		size_t n = 0;
+		for (size_t i = 0; i < points.len; i++) {
+			if (rect_is_inside(args.bounds, points.pts[i])) {
+				points.pts[n] = points.pts[i];
+				points.vals[n] = points.vals[i];
+				n++;
+			}
+		}
+		log_info("Kept %zu points inside the boundaries", n);
+		points.len = n;
+	}
+
+	cl_float2 *projected = NULL;
+	char *projdef = NULL;
+	if (args.proj_meters != NULL) {
+		projdef = proj_definition(args.proj_meters);
+		projected = calloc(points.len, sizeof(projected[0]));
+		if (projected == NULL) {
+			log_error("Failed to allocate memory for the projected points");
+			return EXIT_FAILURE;
+		}
+		memcpy(projected, points.pts, points.len * sizeof(projected[0]));
+		if (wgs84_to_meters_array(projected, points.len, args.proj_meters)) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	ret = points_save_binary(args.outpath, &points, projected, projdef, &src);
+	if (ret == 0) {
+		log_info("Wrote %zu points to %s", points.len, args.outpath);
+	}
+
+	free(projected);
+	free(projdef);
+	points_free(&points);
+	if (args.proj_meters != NULL) {
+		pj_free(args.proj_meters);
+	}
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
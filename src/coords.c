@@ -22,16 +22,27 @@
  * SOFTWARE.
  * */
 
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
-#include <gsl/gsl_blas.h>
-#include <gsl/gsl_vector.h>
-#include <gsl/gsl_matrix.h>
-#include <gsl/gsl_multifit.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "log.h"
 
 #include "coords.h"
 
+// Number of points projected by a single pj_transform call
+#define PROJ_CHUNK		16384
+// How far in meters the batched projection may be off the single point one
+#define PROJ_CHECK_EPS	1.0f
+// The tile transforms are fitted to FIT_SIDE x FIT_SIDE samples of the tile
+#define FIT_SIDE		20
+#define FIT_POINTS		(FIT_SIDE * FIT_SIDE)
+// Number of tiles a worker claims at a time
+#define FIT_CHUNK		64
+
 static projPJ proj_wgs;
 
 void init_projs()
@@ -39,13 +50,26 @@ void init_projs()
 	proj_wgs = pj_init_plus("+init=epsg:4326");
 }
 
+// Canonical form of the projection definition, for comparing projections
+char *proj_definition(projPJ proj)
+{
+	char *def = pj_get_def(proj, 0);
+	if (def == NULL) {
+		return strdup("");
+	}
+	char *ret = strdup(def);
+	pj_dalloc(def);
+	return ret;
+}
+
 cl_float2 wgs84_to_meters(cl_float2 wgs, projPJ proj_meters)
 {
 	cl_float2 ret;
-	// The X and Ys are switched intentionally
-	double ry = wgs.x * DEG_TO_RAD;
+	// The points are (latitude, longitude), proj4 takes the longitude first.
+	// The result is (easting, northing), the frame of everything projected.
 	double rx = wgs.y * DEG_TO_RAD;
-	int err = pj_transform(proj_wgs, proj_meters, 1, 1, &ry, &rx, NULL);
+	double ry = wgs.x * DEG_TO_RAD;
+	int err = pj_transform(proj_wgs, proj_meters, 1, 1, &rx, &ry, NULL);
 	if (err) {
 		log_error("Coordinate conversion failed: %s", pj_strerrno(err));
 	}
@@ -54,63 +78,370 @@ cl_float2 wgs84_to_meters(cl_float2 wgs, projPJ proj_meters)
 	return ret;
 }
 
-void generate_translation_tile(int xtile, int ytile, int zoom, cl_float4 *out, projPJ proj_meters)
+// Runs the worker on a thread per core, but at most nchunks of them
+static void run_workers(void *(*worker)(void *), void *job, size_t nchunks)
 {
-	int side = 20;
-	int npoints = side * side;
-	gsl_multifit_linear_workspace *gwsp = gsl_multifit_linear_alloc(npoints, 3);
-	gsl_vector *yx = gsl_vector_alloc(npoints);
-	gsl_vector *yy = gsl_vector_alloc(npoints);
-	gsl_matrix *X = gsl_matrix_alloc(npoints, 3);
-	gsl_vector *cx = gsl_vector_alloc(3);
-	gsl_vector *cy = gsl_vector_alloc(3);
-	gsl_matrix *cov = gsl_matrix_alloc(npoints, npoints);
-	double chisq;
-
-	// Generate side x side training points
-	for (int x = 0; x < side; x++) {
-		for (int y = 0; y < side; y++) {
-			cl_float2 tile = {.x = xtile + (double)x / side,
-							  .y = ytile + (double)y / side};
-			cl_float2 wgs = tile_to_wgs84(tile, zoom);
-			cl_float2 mets = wgs84_to_meters(wgs, proj_meters);
-
-			int pt = x * side + y;
-			// Inputs
-			gsl_matrix_set(X, pt, 0, tile.x - xtile);
-			gsl_matrix_set(X, pt, 1, tile.y - ytile);
-			gsl_matrix_set(X, pt, 2,	 1);
-
-			// Outputs
-			gsl_vector_set(yx, pt, mets.x);
-			gsl_vector_set(yy, pt, mets.y);
+	size_t ncpus = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+	size_t nthreads = min(ncpus, nchunks);
+	pthread_t threads[nthreads];
+	size_t started = 0;
+	for (; started < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL, worker, job)) {
+			break;
+		}
+	}
+	if (started == 0) {
+		// Do it ourselves then
+		worker(job);
+	}
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
 
+struct proj_job {
+	cl_float2 *pts;
+	size_t npts;
+	size_t next; // First point of the next unclaimed chunk
+	const char *def;
+	int err;
+};
+
+static void *proj_worker(void *arg)
+{
+	struct proj_job *job = arg;
+
+	// projPJs are not thread safe, so every thread gets its own context
+	projCtx ctx = pj_ctx_alloc();
+	projPJ wgs = pj_init_plus_ctx(ctx, "+init=epsg:4326");
+	projPJ meters = pj_init_plus_ctx(ctx, job->def);
+	double *xs = calloc(PROJ_CHUNK, sizeof(double));
+	double *ys = calloc(PROJ_CHUNK, sizeof(double));
+	if (wgs == NULL || meters == NULL || xs == NULL || ys == NULL) {
+		log_error("Failed to initialize a projection worker");
+		__atomic_store_n(&job->err, -1, __ATOMIC_RELAXED);
+		goto out;
+	}
+
+	while (true) {
+		size_t start = __atomic_fetch_add(&job->next, PROJ_CHUNK, __ATOMIC_RELAXED);
+		if (start >= job->npts) {
+			break;
+		}
+		size_t n = min(job->npts - start, (size_t)PROJ_CHUNK);
+		cl_float2 *pts = &job->pts[start];
+
+		// Longitude first, same as in wgs84_to_meters
+		for (size_t i = 0; i < n; i++) {
+			xs[i] = pts[i].y * DEG_TO_RAD;
+			ys[i] = pts[i].x * DEG_TO_RAD;
+		}
+		int err = pj_transform(wgs, meters, n, 1, xs, ys, NULL);
+		if (err) {
+			log_error("Coordinate conversion failed: %s", pj_strerrno(err));
+		}
+		for (size_t i = 0; i < n; i++) {
+			pts[i].x = xs[i];
+			pts[i].y = ys[i];
 		}
 	}
 
-	// Fit
-	gsl_multifit_linear(X, yx, cx, cov, &chisq, gwsp);
-	gsl_multifit_linear(X, yy, cy, cov, &chisq, gwsp);
+out:
+	free(xs);
+	free(ys);
+	if (meters != NULL) {
+		pj_free(meters);
+	}
+	if (wgs != NULL) {
+		pj_free(wgs);
+	}
+	pj_ctx_free(ctx);
+	return NULL;
+}
 
-	gsl_matrix *mtrans = gsl_matrix_alloc(3, 2);
-	gsl_matrix_set_col(mtrans, 0, cx);
-	gsl_matrix_set_col(mtrans, 1, cy);
+// Projects the points in place, in chunks spread over all available cores
+int wgs84_to_meters_array(cl_float2 *pts, size_t npts, projPJ proj_meters)
+{
+	if (npts == 0) {
+		return 0;
+	}
+
+	char *def = proj_definition(proj_meters);
+	struct proj_job job = {
+		.pts = pts,
+		.npts = npts,
+		.next = 0,
+		.def = def,
+		.err = 0,
+	};
+
+	// The points have to end up in the same frame as with wgs84_to_meters,
+	// which the tile transforms use
+	cl_float2 first = wgs84_to_meters(pts[0], proj_meters);
+
+	run_workers(proj_worker, &job, (npts + PROJ_CHUNK - 1) / PROJ_CHUNK);
+
+	free(def);
+	if (job.err == 0 && isfinite(first.x) && isfinite(first.y) &&
+			(fabsf(pts[0].x - first.x) > PROJ_CHECK_EPS ||
+			 fabsf(pts[0].y - first.y) > PROJ_CHECK_EPS)) {
+		log_error("The batched projection put the first point at (%f, %f) instead of (%f, %f)",
+				  pts[0].x, pts[0].y, first.x, first.y);
+		return -1;
+	}
+	return job.err;
+}
+
+// The samples are at the same place in every tile, so the least squares fit
+// is always the same linear map of the projected samples, the pseudo-inverse
+// (X^T X)^-1 X^T of the design matrix X with the rows (u, v, 1, uv, u^2, v^2),
+// only the first three of them for the affine transforms
+static double fit_pinv[TRANSFORM_QUADRATIC][TRANSFORM_TERMS][FIT_POINTS];
+static pthread_once_t fit_once = PTHREAD_ONCE_INIT;
+
+static int fit_nterms(int order)
+{
+	return order == TRANSFORM_QUADRATIC ? TRANSFORM_TERMS : 3;
+}
+
+// The samples include the right and bottom edges, the quadratic terms would
+// be off the most there otherwise
+static void fit_sample(int pt, double *row)
+{
+	double u = (double)(pt / FIT_SIDE) / (FIT_SIDE - 1);
+	double v = (double)(pt % FIT_SIDE) / (FIT_SIDE - 1);
+	double terms[TRANSFORM_TERMS] = { u, v, 1.0, u * v, u * u, v * v };
+	memcpy(row, terms, sizeof(terms));
+}
+
+static void fit_init_order(int order)
+{
+	int n = fit_nterms(order);
+	double xtx[TRANSFORM_TERMS][TRANSFORM_TERMS] = { { 0.0 } };
+	double inv[TRANSFORM_TERMS][TRANSFORM_TERMS] = { { 0.0 } };
+	for (int pt = 0; pt < FIT_POINTS; pt++) {
+		double row[TRANSFORM_TERMS];
+		fit_sample(pt, row);
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++) {
+				xtx[i][j] += row[i] * row[j];
+			}
+		}
+	}
+
+	// Gauss-Jordan elimination, X^T X is symmetric positive definite, so it
+	// does not need any pivoting
+	for (int i = 0; i < n; i++) {
+		inv[i][i] = 1.0;
+	}
+	for (int col = 0; col < n; col++) {
+		double pivot = xtx[col][col];
+		for (int j = 0; j < n; j++) {
+			xtx[col][j] /= pivot;
+			inv[col][j] /= pivot;
+		}
+		for (int i = 0; i < n; i++) {
+			if (i == col) {
+				continue;
+			}
+			double f = xtx[i][col];
+			for (int j = 0; j < n; j++) {
+				xtx[i][j] -= f * xtx[col][j];
+				inv[i][j] -= f * inv[col][j];
+			}
+		}
+	}
 
-	// Output
+	for (int pt = 0; pt < FIT_POINTS; pt++) {
+		double row[TRANSFORM_TERMS];
+		fit_sample(pt, row);
+		for (int i = 0; i < n; i++) {
+			double sum = 0.0;
+			for (int j = 0; j < n; j++) {
+				sum += inv[i][j] * row[j];
+			}
+			fit_pinv[order - 1][i][pt] = sum;
+		}
+	}
+}
+
+static void fit_init(void)
+{
+	fit_init_order(TRANSFORM_AFFINE);
+	fit_init_order(TRANSFORM_QUADRATIC);
+}
+
+// Projects the samples of the tile in a single call and fits the transform
+static int fit_tile(int xtile, int ytile, int zoom, int order, projPJ wgs, projPJ meters,
+					cl_float8 *out)
+{
+	double xs[FIT_POINTS];
+	double ys[FIT_POINTS];
+	double scale = pow(2.0, zoom);
+	for (int pt = 0; pt < FIT_POINTS; pt++) {
+		double row[TRANSFORM_TERMS];
+		fit_sample(pt, row);
+		// Same as tile_to_wgs84, just without the rounding to floats
+		double n = M_PI - 2.0 * M_PI * (ytile + row[1]) / scale;
+		// Longitude first, same as in wgs84_to_meters
+		xs[pt] = ((xtile + row[0]) / scale * 360.0 - 180.0) * DEG_TO_RAD;
+		ys[pt] = atan(sinh(n));
+	}
+	int err = pj_transform(wgs, meters, FIT_POINTS, 1, xs, ys, NULL);
+	if (err) {
+		log_error("Coordinate conversion failed: %s", pj_strerrno(err));
+	}
+
+	memset(out, 0, 2 * sizeof(out[0]));
+	for (int i = 0; i < fit_nterms(order); i++) {
+		double cx = 0.0;
+		double cy = 0.0;
+		for (int pt = 0; pt < FIT_POINTS; pt++) {
+			cx += fit_pinv[order - 1][i][pt] * xs[pt];
+			cy += fit_pinv[order - 1][i][pt] * ys[pt];
+		}
+		out[0].s[i] = cx;
+		out[1].s[i] = cy;
+	}
+	return err ? -1 : 0;
+}
+
+void generate_translation_tile(int xtile, int ytile, int zoom, int order, cl_float8 *out,
+							   projPJ proj_meters)
+{
+	pthread_once(&fit_once, fit_init);
+	fit_tile(xtile, ytile, zoom, order, proj_wgs, proj_meters, out);
+}
+
+// Fits the transform of the order to the tile and compares it with the
+// exact projection on npts random points of the tile. The differences in
+// meters go to errs, the side of the tile in meters to side.
+int sample_transform_errors(int xtile, int ytile, int zoom, int order, size_t npts,
+							unsigned int *seed, cl_float2 *errs, float *side,
+							projPJ proj_meters)
+{
+	cl_float8 tr[2];
+	generate_translation_tile(xtile, ytile, zoom, order, tr, proj_meters);
+	*side = sqrt(fabs(tr[0].s[0] * tr[1].s[1] - tr[0].s[1] * tr[1].s[0]));
+
+	cl_float2 *uvs = calloc(npts, sizeof(cl_float2));
+	double *xs = calloc(npts, sizeof(double));
+	double *ys = calloc(npts, sizeof(double));
+	int ret = -1;
+	if (uvs == NULL || xs == NULL || ys == NULL) {
+		log_error("Failed to allocate the sample points");
+		goto out;
+	}
+	double scale = pow(2.0, zoom);
+	for (size_t i = 0; i < npts; i++) {
+		uvs[i].x = (float)rand_r(seed) / RAND_MAX;
+		uvs[i].y = (float)rand_r(seed) / RAND_MAX;
+		double n = M_PI - 2.0 * M_PI * (ytile + uvs[i].y) / scale;
+		xs[i] = ((xtile + uvs[i].x) / scale * 360.0 - 180.0) * DEG_TO_RAD;
+		ys[i] = atan(sinh(n));
+	}
+	int err = pj_transform(proj_wgs, proj_meters, npts, 1, xs, ys, NULL);
+	if (err) {
+		log_error("Coordinate conversion failed: %s", pj_strerrno(err));
+		goto out;
+	}
+	// In doubles, the rounding of the coordinates to floats is the same for
+	// every order and would only drown the error of the fit
+	for (size_t i = 0; i < npts; i++) {
+		double u = uvs[i].x;
+		double v = uvs[i].y;
+		double at[TRANSFORM_TERMS] = { u, v, 1.0, u * v, u * u, v * v };
+		double fx = 0.0;
+		double fy = 0.0;
+		for (int k = 0; k < TRANSFORM_TERMS; k++) {
+			fx += at[k] * tr[0].s[k];
+			fy += at[k] * tr[1].s[k];
+		}
+		errs[i].x = fabs(xs[i] - fx);
+		errs[i].y = fabs(ys[i] - fy);
+	}
+	ret = 0;
+
+out:
+	free(uvs);
+	free(xs);
+	free(ys);
+	return ret;
+}
+
+struct fit_job {
+	int zoom;
+	int order;
+	const cl_uint2 *tiles;
+	cl_float8 *out;
+	size_t ntiles;
+	size_t next; // First tile of the next unclaimed chunk
+	const char *def;
+	int err;
+};
+
+static void *fit_worker(void *arg)
+{
+	struct fit_job *job = arg;
+
+	// Same as in proj_worker, every thread needs its own context
+	projCtx ctx = pj_ctx_alloc();
+	projPJ wgs = pj_init_plus_ctx(ctx, "+init=epsg:4326");
+	projPJ meters = pj_init_plus_ctx(ctx, job->def);
+	if (wgs == NULL || meters == NULL) {
+		log_error("Failed to initialize a projection worker");
+		__atomic_store_n(&job->err, -1, __ATOMIC_RELAXED);
+		goto out;
+	}
+
+	while (true) {
+		size_t start = __atomic_fetch_add(&job->next, FIT_CHUNK, __ATOMIC_RELAXED);
+		if (start >= job->ntiles) {
+			break;
+		}
+		size_t end = min(job->ntiles, start + FIT_CHUNK);
+		for (size_t i = start; i < end; i++) {
+			if (fit_tile(job->tiles[i].x, job->tiles[i].y, job->zoom, job->order, wgs,
+						 meters, &job->out[2 * i])) {
+				__atomic_store_n(&job->err, -1, __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+out:
+	if (meters != NULL) {
+		pj_free(meters);
+	}
+	if (wgs != NULL) {
+		pj_free(wgs);
+	}
+	pj_ctx_free(ctx);
+	return NULL;
+}
+
+// Generates the transforms of the order for the tiles of the zoomlevel on
+// all the cores, two cl_float8 per tile into out
+int generate_translation_tiles(int zoom, int order, const cl_uint2 *tiles, size_t ntiles,
+							   cl_float8 *out, projPJ proj_meters)
+{
+	if (ntiles == 0) {
+		return 0;
+	}
+	pthread_once(&fit_once, fit_init);
 
-	out[0].x = gsl_matrix_get(mtrans, 0, 0);
-	out[0].y = gsl_matrix_get(mtrans, 1, 0);
-	out[0].z = gsl_matrix_get(mtrans, 2, 0);
-	out[1].x = gsl_matrix_get(mtrans, 0, 1);
-	out[1].y = gsl_matrix_get(mtrans, 1, 1);
-	out[1].z = gsl_matrix_get(mtrans, 2, 1);
+	char *def = proj_definition(proj_meters);
+	struct fit_job job = {
+		.zoom = zoom,
+		.order = order,
+		.tiles = tiles,
+		.out = out,
+		.ntiles = ntiles,
+		.next = 0,
+		.def = def,
+		.err = 0,
+	};
+	run_workers(fit_worker, &job, (ntiles + FIT_CHUNK - 1) / FIT_CHUNK);
 
-	gsl_matrix_free(mtrans);
-	gsl_matrix_free(cov);
-	gsl_vector_free(cy);
-	gsl_vector_free(cx);
-	gsl_matrix_free(X);
-	gsl_vector_free(yy);
-	gsl_vector_free(yx);
-	gsl_multifit_linear_free(gwsp);
+	free(def);
+	return job.err;
 }
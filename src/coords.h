@@ -59,6 +59,16 @@ static inline cl_float2 tile_to_wgs84(cl_float2 tile, int z)
 	return ret;
 }
 
+// Mean radius of the Earth in meters, the great circle kernels use the same
+#define EARTH_RADIUS			6371008.8
+
+// Orders of the tile transforms. Each of the two cl_float8 of a transform
+// holds the coefficients of (u, v, 1, uv, u^2, v^2), the quadratic terms are
+// zero for the affine transforms.
+#define TRANSFORM_AFFINE		1
+#define TRANSFORM_QUADRATIC		2
+#define TRANSFORM_TERMS			6
+
 struct rect {
 	cl_float2 lt; // Left top
 	cl_float2 rb; // Right bottom
@@ -164,8 +174,16 @@ static inline struct rect rect_max(cl_float2 *pts, size_t npts)
 }
 
 void init_projs();
+char *proj_definition(projPJ proj);
 cl_float2 wgs84_to_meters(cl_float2 wgs, projPJ proj_meters);
-void generate_translation_tile(int xtile, int ytile, int zoom, cl_float4 *out, projPJ proj_meters);
+int wgs84_to_meters_array(cl_float2 *pts, size_t npts, projPJ proj_meters);
+void generate_translation_tile(int xtile, int ytile, int zoom, int order, cl_float8 *out,
+							   projPJ proj_meters);
+int generate_translation_tiles(int zoom, int order, const cl_uint2 *tiles, size_t ntiles,
+							   cl_float8 *out, projPJ proj_meters);
+int sample_transform_errors(int xtile, int ytile, int zoom, int order, size_t npts,
+							unsigned int *seed, cl_float2 *errs, float *side,
+							projPJ proj_meters);
 
 static inline cl_float2 tile_to_meters(cl_float2 tile, int zoom, projPJ proj_meters)
 {
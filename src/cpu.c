@@ -0,0 +1,287 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#include <ctype.h>
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "colormaps.h"
+#include "log.h"
+#include "utils.h"
+
+#include "cpu.h"
+
+// Same as tile_to_cartesian in kernels/common.h
+static inline cl_float2 pixel_to_cartesian(const struct cpu_kernel *krn,
+										   const cl_float8 *tr, int x, int y)
+{
+	float u = (float)x / krn->tile_size;
+	float v = (float)y / krn->tile_size;
+	float at[6] = { u, v, 1.0f, u * v, u * u, v * v };
+	cl_float2 ret = { .x = 0.0f, .y = 0.0f };
+	for (int i = 0; i < 6; i++) {
+		ret.x += at[i] * tr[0].s[i];
+		ret.y += at[i] * tr[1].s[i];
+	}
+	return ret;
+}
+
+static inline uint8_t heat_color(const struct cpu_kernel *krn, int x, int y,
+								 float val, float sw, float best)
+{
+	int cid = 0;
+	if (best < krn->range * krn->range && sw > 0.0f) {
+		val /= sw;
+		float rval = (val - krn->min) / krn->max;
+		// Clamped before the conversion, which would overflow otherwise
+		cid = clamp(rval * COLORMAP_LEN, 1.0f, COLORMAP_LEN - 1.0f);
+	}
+	if (krn->highlight_borders && (x % krn->subtile_size == 0 ||
+			y % krn->subtile_size == 0 || x % krn->subtile_size == krn->subtile_size - 1 ||
+			y % krn->subtile_size == krn->subtile_size - 1)) {
+		cid = 150;
+	}
+	return cid;
+}
+
+static inline uint8_t density_color(const struct cpu_kernel *krn, float density)
+{
+	int cid = 0;
+	if (density > 0.0f) {
+		float rval = (density - krn->min) / krn->max;
+		cid = clamp(rval * COLORMAP_LEN, 1.0f, COLORMAP_LEN - 1.0f);
+	}
+	return cid;
+}
+
+static inline uint8_t tdoa_color(const struct cpu_kernel *krn, float err)
+{
+	err = sqrtf(err) / krn->scale_by;
+	int cid = clamp(err * COLORMAP_LEN, 0.0f, COLORMAP_LEN - 1.0f);
+	return COLORMAP_LEN - cid - 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define LANES 8
+#define vfloat __m256
+#define v_set1 _mm256_set1_ps
+#define v_load _mm256_loadu_ps
+#define v_store _mm256_storeu_ps
+#define v_add _mm256_add_ps
+#define v_sub _mm256_sub_ps
+#define v_mul _mm256_mul_ps
+#define v_div _mm256_div_ps
+#define v_min _mm256_min_ps
+#define v_max _mm256_max_ps
+#define v_sqrt _mm256_sqrt_ps
+#define v_mask_lt(a, b, x) _mm256_and_ps(_mm256_cmp_ps((a), (b), _CMP_LT_OQ), (x))
+#define SIMD_TARGET __attribute__((target("avx2")))
+#define SIMD_FN(name) name##_avx2
+#include "cpu_simd.h"
+#undef LANES
+#undef vfloat
+#undef v_set1
+#undef v_load
+#undef v_store
+#undef v_add
+#undef v_sub
+#undef v_mul
+#undef v_div
+#undef v_min
+#undef v_max
+#undef v_sqrt
+#undef v_mask_lt
+#undef SIMD_TARGET
+#undef SIMD_FN
+
+#define LANES 4
+#define vfloat __m128
+#define v_set1 _mm_set1_ps
+#define v_load _mm_loadu_ps
+#define v_store _mm_storeu_ps
+#define v_add _mm_add_ps
+#define v_sub _mm_sub_ps
+#define v_mul _mm_mul_ps
+#define v_div _mm_div_ps
+#define v_min _mm_min_ps
+#define v_max _mm_max_ps
+#define v_sqrt _mm_sqrt_ps
+#define v_mask_lt(a, b, x) _mm_and_ps(_mm_cmplt_ps((a), (b)), (x))
+#define SIMD_TARGET __attribute__((target("sse2")))
+#define SIMD_FN(name) name##_sse
+#include "cpu_simd.h"
+#undef LANES
+#undef vfloat
+#undef v_set1
+#undef v_load
+#undef v_store
+#undef v_add
+#undef v_sub
+#undef v_mul
+#undef v_div
+#undef v_min
+#undef v_max
+#undef v_sqrt
+#undef v_mask_lt
+#undef SIMD_TARGET
+#undef SIMD_FN
+
+#else
+
+// Plain C for everything else, left to the compiler to vectorize
+#define LANES 1
+#define vfloat float
+#define v_set1(a) (a)
+#define v_load(p) (*(p))
+#define v_store(p, a) (*(p) = (a))
+#define v_add(a, b) ((a) + (b))
+#define v_sub(a, b) ((a) - (b))
+#define v_mul(a, b) ((a) * (b))
+#define v_div(a, b) ((a) / (b))
+#define v_min(a, b) ((a) < (b) ? (a) : (b))
+#define v_max(a, b) ((a) > (b) ? (a) : (b))
+#define v_sqrt sqrtf
+#define v_mask_lt(a, b, x) ((a) < (b) ? (x) : 0.0f)
+#define SIMD_TARGET
+#define SIMD_FN(name) name##_scalar
+#include "cpu_simd.h"
+
+#endif
+
+// Finds the value of the last -DNAME or -DNAME=VALUE in the compiler arguments
+int cpu_find_define(const char *compargs, const char *name, float *out)
+{
+	size_t namelen = strlen(name);
+	int ret = -1;
+
+	for (const char *opt = strstr(compargs, "-D"); opt != NULL;
+			opt = strstr(opt + 2, "-D")) {
+		if (opt != compargs && !isspace((unsigned char)opt[-1])) {
+			continue;
+		}
+		const char *def = opt + 2;
+		def += strspn(def, " \t");
+		if (strncmp(def, name, namelen)) {
+			continue;
+		}
+		const char *end = def + namelen;
+		if (*end == '\0' || isspace((unsigned char)*end)) {
+			*out = 1.0f;
+			ret = 0;
+		} else if (*end == '=') {
+			char *valend;
+			float val = strtof(end + 1, &valend);
+			if (valend != end + 1 && (*valend == '\0' || isspace((unsigned char)*valend))) {
+				*out = val;
+				ret = 0;
+			}
+		}
+	}
+
+	return ret;
+}
+
+static int require_define(const char *kname, const char *compargs,
+						  const char *name, float *out)
+{
+	if (cpu_find_define(compargs, name, out)) {
+		log_error("The %s kernel needs -D%s=... in the compiler arguments", kname, name);
+		return -1;
+	}
+	return 0;
+}
+
+const char *cpu_kernel_isa()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_cpu_supports("avx2") ? "AVX2" : "SSE2";
+#else
+	return "scalar";
+#endif
+}
+
+// The name is the kernel as given on the command line, only its basename
+// without the .cl suffix matters
+int cpu_kernel_init(struct cpu_kernel *krn, const char *name,
+					const char *compargs, int tile_size)
+{
+	const char *base = strrchr(name, '/');
+	base = base != NULL ? base + 1 : name;
+	size_t baselen = strends(base, ".cl") ? strlen(base) - 3 : strlen(base);
+
+	memset(krn, 0, sizeof(*krn));
+	krn->tile_size = tile_size;
+	float subtile;
+	krn->subtile_size = cpu_find_define(compargs, "SUBTILE_SIZE", &subtile) ?
+		tile_size : (int)subtile;
+	float flag;
+	krn->highlight_borders = !cpu_find_define(compargs, "HIGHLIGHT_BORDERS", &flag);
+#if defined(__x86_64__) || defined(__i386__)
+	bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+	if (baselen == strlen("heat") && !strncmp(base, "heat", baselen)) {
+		if (require_define("heat", compargs, "RANGE", &krn->range) ||
+				require_define("heat", compargs, "MIN", &krn->min) ||
+				require_define("heat", compargs, "MAX", &krn->max)) {
+			return -1;
+		}
+#if defined(__x86_64__) || defined(__i386__)
+		krn->render = avx2 ? heat_tile_avx2 : heat_tile_sse;
+#else
+		krn->render = heat_tile_scalar;
+#endif
+	} else if (baselen == strlen("density") && !strncmp(base, "density", baselen)) {
+		if (require_define("density", compargs, "RANGE", &krn->range) ||
+				require_define("density", compargs, "MIN", &krn->min) ||
+				require_define("density", compargs, "MAX", &krn->max)) {
+			return -1;
+		}
+#if defined(__x86_64__) || defined(__i386__)
+		krn->render = avx2 ? density_tile_avx2 : density_tile_sse;
+#else
+		krn->render = density_tile_scalar;
+#endif
+	} else if (baselen == strlen("tdoa") && !strncmp(base, "tdoa", baselen)) {
+		if (require_define("tdoa", compargs, "SCALE_BY", &krn->scale_by)) {
+			return -1;
+		}
+#if defined(__x86_64__) || defined(__i386__)
+		krn->render = avx2 ? tdoa_tile_avx2 : tdoa_tile_sse;
+#else
+		krn->render = tdoa_tile_scalar;
+#endif
+	} else {
+		log_error("The CPU backend only implements the heat, density and tdoa kernels");
+		return -1;
+	}
+
+	return 0;
+}
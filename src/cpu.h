@@ -0,0 +1,68 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <CL/cl.h>
+
+struct cpu_kernel;
+
+typedef void (*cpu_render_fn)(const struct cpu_kernel *krn, const cl_float8 *tr,
+							  cl_uint nranges, const cl_uint2 *ranges,
+							  const cl_float2 *pts, const float *vals, uint8_t *out);
+
+// C implementations of the heat, density and tdoa kernels, for machines without
+// a usable OpenCL device. They take the same -D definitions as the OpenCL
+// sources and render the tile as an 8-bit index into the colormap.
+struct cpu_kernel {
+	int tile_size;
+	// Size of the output tiles a metatile is sliced into, for the borders
+	int subtile_size;
+	float range;
+	float min;
+	float max;
+	float scale_by;
+	// Index of the reference point of tdoa, set by the caller
+	cl_uint refpt;
+	bool highlight_borders;
+	cpu_render_fn render;
+};
+
+int cpu_find_define(const char *compargs, const char *name, float *out);
+int cpu_kernel_init(struct cpu_kernel *krn, const char *name,
+					const char *compargs, int tile_size);
+const char *cpu_kernel_isa();
+
+static inline void cpu_render_tile(const struct cpu_kernel *krn, const cl_float8 *tr,
+								   cl_uint nranges, const cl_uint2 *ranges,
+								   const cl_float2 *pts, const float *vals,
+								   uint8_t *out)
+{
+	krn->render(krn, tr, nranges, ranges, pts, vals, out);
+}
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+// Body of the CPU kernels, included by cpu.c once per instruction set.
+// The includer defines LANES, the vfloat type with the v_* operations on it,
+// SIMD_TARGET and SIMD_FN to name the functions.
+
+SIMD_TARGET
+static void SIMD_FN(load_pixels)(const struct cpu_kernel *krn, const cl_float8 *tr,
+								 int x, int y, vfloat *sx, vfloat *sy)
+{
+	float lx[LANES], ly[LANES];
+	for (int k = 0; k < LANES; k++) {
+		cl_float2 self = pixel_to_cartesian(krn, tr, x + k, y);
+		lx[k] = self.x;
+		ly[k] = self.y;
+	}
+	*sx = v_load(lx);
+	*sy = v_load(ly);
+}
+
+SIMD_TARGET
+static void SIMD_FN(heat_tile)(const struct cpu_kernel *krn, const cl_float8 *tr,
+							   cl_uint nranges, const cl_uint2 *ranges,
+							   const cl_float2 *pts, const float *vals, uint8_t *out)
+{
+	const vfloat bw = v_set1(krn->range * krn->range);
+	const vfloat lo = v_set1(-0.9999f);
+	const vfloat hi = v_set1(0.9999f);
+	const vfloat one = v_set1(1.0f);
+	const vfloat scale = v_set1(15.0f / 16.0f);
+
+	for (int y = 0; y < krn->tile_size; y++) {
+		for (int x = 0; x < krn->tile_size; x += LANES) {
+			vfloat sx, sy;
+			SIMD_FN(load_pixels)(krn, tr, x, y, &sx, &sy);
+
+			vfloat val = v_set1(0.0f);
+			vfloat sw = v_set1(0.0f);
+			vfloat best = v_set1(FLT_MAX);
+			for (cl_uint r = 0; r < nranges; r++) {
+				for (cl_uint i = ranges[r].x; i < ranges[r].y; i++) {
+					vfloat dx = v_sub(sx, v_set1(pts[i].x));
+					vfloat dy = v_sub(sy, v_set1(pts[i].y));
+					vfloat dist = v_add(v_mul(dx, dx), v_mul(dy, dy));
+					vfloat t = v_min(v_max(v_div(dist, bw), lo), hi);
+					vfloat omt = v_sub(one, t);
+					vfloat w = v_mul(scale, v_mul(omt, omt));
+					best = v_min(best, dist);
+					sw = v_add(sw, w);
+					val = v_add(val, v_mul(v_set1(vals[i]), w));
+				}
+			}
+
+			float lval[LANES], lsw[LANES], lbest[LANES];
+			v_store(lval, val);
+			v_store(lsw, sw);
+			v_store(lbest, best);
+			for (int k = 0; k < LANES && x + k < krn->tile_size; k++) {
+				out[y * krn->tile_size + x + k] =
+					heat_color(krn, x + k, y, lval[k], lsw[k], lbest[k]);
+			}
+		}
+	}
+}
+
+SIMD_TARGET
+static void SIMD_FN(density_tile)(const struct cpu_kernel *krn, const cl_float8 *tr,
+								  cl_uint nranges, const cl_uint2 *ranges,
+								  const cl_float2 *pts, const float *vals, uint8_t *out)
+{
+	const vfloat bw = v_set1(krn->range * krn->range);
+	const vfloat one = v_set1(1.0f);
+	const vfloat scale = v_set1(15.0f / 16.0f);
+
+	for (int y = 0; y < krn->tile_size; y++) {
+		for (int x = 0; x < krn->tile_size; x += LANES) {
+			vfloat sx, sy;
+			SIMD_FN(load_pixels)(krn, tr, x, y, &sx, &sy);
+
+			vfloat density = v_set1(0.0f);
+			for (cl_uint r = 0; r < nranges; r++) {
+				for (cl_uint i = ranges[r].x; i < ranges[r].y; i++) {
+					vfloat dx = v_sub(sx, v_set1(pts[i].x));
+					vfloat dy = v_sub(sy, v_set1(pts[i].y));
+					vfloat dist = v_add(v_mul(dx, dx), v_mul(dy, dy));
+					vfloat omt = v_sub(one, v_div(dist, bw));
+					vfloat w = v_mul(scale, v_mul(omt, omt));
+					// Only the points within RANGE add up
+					density = v_add(density, v_mask_lt(dist, bw, v_mul(v_set1(vals[i]), w)));
+				}
+			}
+
+			float ldensity[LANES];
+			v_store(ldensity, density);
+			for (int k = 0; k < LANES && x + k < krn->tile_size; k++) {
+				out[y * krn->tile_size + x + k] = density_color(krn, ldensity[k]);
+			}
+		}
+	}
+}
+
+SIMD_TARGET
+static void SIMD_FN(tdoa_tile)(const struct cpu_kernel *krn, const cl_float8 *tr,
+							   cl_uint nranges, const cl_uint2 *ranges,
+							   const cl_float2 *pts, const float *vals, uint8_t *out)
+{
+	// The first input point is the reference the time differences are
+	// relative to, whether or not it is among the points of the tile
+	cl_uint ref = krn->refpt;
+
+	for (int y = 0; y < krn->tile_size; y++) {
+		for (int x = 0; x < krn->tile_size; x += LANES) {
+			vfloat sx, sy;
+			SIMD_FN(load_pixels)(krn, tr, x, y, &sx, &sy);
+
+			vfloat dx = v_sub(sx, v_set1(pts[ref].x));
+			vfloat dy = v_sub(sy, v_set1(pts[ref].y));
+			vfloat dist = v_sqrt(v_add(v_mul(dx, dx), v_mul(dy, dy)));
+			vfloat err = v_set1(0.0f);
+			for (cl_uint r = 0; r < nranges; r++) {
+				for (cl_uint i = ranges[r].x; i < ranges[r].y; i++) {
+					if (i == ref) {
+						continue;
+					}
+					dx = v_sub(sx, v_set1(pts[i].x));
+					dy = v_sub(sy, v_set1(pts[i].y));
+					vfloat dist2 = v_sqrt(v_add(v_mul(dx, dx), v_mul(dy, dy)));
+					vfloat ad = v_sub(v_sub(dist, dist2), v_set1(vals[i]));
+					err = v_add(err, v_mul(ad, ad));
+				}
+			}
+
+			float lerr[LANES];
+			v_store(lerr, err);
+			for (int k = 0; k < LANES && x + k < krn->tile_size; k++) {
+				out[y * krn->tile_size + x + k] = tdoa_color(krn, lerr[k]);
+			}
+		}
+	}
+}
@@ -0,0 +1,275 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "utils.h"
+
+#include "grid.h"
+
+// Average number of points we aim for in a single grid cell
+#define GRID_POINTS_PER_CELL	16
+#define GRID_MAX_SIDE			4096u
+#define GRID_MAX_CELLS			(1u << 22)
+// The cells are at most this fraction of the smallest prefilter
+#define GRID_PREFILTER_CELLS	4
+
+static unsigned int grid_cell_x(struct grid *grid, float x)
+{
+	float cx = floorf((x - rect_left(grid->bounds)) / grid->cellsize);
+	return clamp(cx, 0, grid->width - 1);
+}
+
+static unsigned int grid_cell_y(struct grid *grid, float y)
+{
+	float cy = floorf((y - rect_top(grid->bounds)) / grid->cellsize);
+	return clamp(cy, 0, grid->height - 1);
+}
+
+static inline bool point_is_finite(cl_float2 pt)
+{
+	return isfinite(pt.x) && isfinite(pt.y);
+}
+
+static uint32_t morton_code(uint32_t x, uint32_t y)
+{
+	uint32_t ret = 0;
+	for (unsigned int i = 0; i < 16; i++) {
+		ret |= ((x >> i) & 1) << (2 * i);
+		ret |= ((y >> i) & 1) << (2 * i + 1);
+	}
+	return ret;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a;
+	uint64_t ub = *(const uint64_t *)b;
+	return (ua > ub) - (ua < ub);
+}
+
+static int cmp_ranges(const void *a, const void *b)
+{
+	cl_uint ra = ((const cl_uint2 *)a)->x;
+	cl_uint rb = ((const cl_uint2 *)b)->x;
+	return (ra > rb) - (ra < rb);
+}
+
+// Orders the cells along the Morton curve
+static int grid_rank_cells(struct grid *grid)
+{
+	size_t ncells = (size_t)grid->width * grid->height;
+	// Curve position in the upper half, cell index in the lower one
+	uint64_t *order = calloc(ncells, sizeof(order[0]));
+	if (order == NULL) {
+		return -1;
+	}
+
+	for (unsigned int cy = 0; cy < grid->height; cy++) {
+		for (unsigned int cx = 0; cx < grid->width; cx++) {
+			size_t cid = (size_t)cy * grid->width + cx;
+			order[cid] = (uint64_t)morton_code(cx, cy) << 32 | cid;
+		}
+	}
+	qsort(order, ncells, sizeof(order[0]), cmp_u64);
+	for (size_t i = 0; i < ncells; i++) {
+		grid->cellrank[order[i] & UINT32_MAX] = i;
+	}
+
+	free(order);
+	return 0;
+}
+
+// Prefilter is the smallest one the grid gets queried with, or infinity.
+// Follow is the index of a point, updated to where the sorting moves it.
+int grid_build(struct grid *grid, cl_float2 *pts, float *vals, size_t npts,
+			   float prefilter, cl_uint *follow)
+{
+	memset(grid, 0, sizeof(*grid));
+
+	// Points which failed to project are moved past the last cell
+	size_t nfinite = 0;
+	cl_float2 lt = { .x = INFINITY, .y = INFINITY };
+	cl_float2 rb = { .x = -INFINITY, .y = -INFINITY };
+	for (size_t i = 0; i < npts; i++) {
+		if (!point_is_finite(pts[i])) {
+			continue;
+		}
+		lt.x = min(pts[i].x, lt.x);
+		lt.y = min(pts[i].y, lt.y);
+		rb.x = max(pts[i].x, rb.x);
+		rb.y = max(pts[i].y, rb.y);
+		nfinite++;
+	}
+	if (nfinite == 0) {
+		lt = rb = (cl_float2){ .x = 0, .y = 0 };
+	}
+	grid->bounds = rect_make(lt, rb);
+
+	float w = rect_right(grid->bounds) - rect_left(grid->bounds);
+	float h = rect_bot(grid->bounds) - rect_top(grid->bounds);
+	size_t ncells = max(nfinite / GRID_POINTS_PER_CELL, (size_t)1);
+	grid->cellsize = sqrtf(w * h / ncells);
+	// Degenerate (all points on a line) inputs
+	grid->cellsize = max(grid->cellsize, max(w, h) / ncells);
+	// Sparse points would end up in cells much larger than the prefilter
+	grid->cellsize = min(grid->cellsize, prefilter / GRID_PREFILTER_CELLS);
+	grid->cellsize = max(grid->cellsize, sqrtf(w * h / GRID_MAX_CELLS));
+	grid->cellsize = max(grid->cellsize, max(w, h) / GRID_MAX_SIDE);
+	if (!(grid->cellsize > 0)) {
+		grid->cellsize = 1.0;
+	}
+	grid->width = min((unsigned int)(w / grid->cellsize) + 1, GRID_MAX_SIDE);
+	grid->height = min((unsigned int)(h / grid->cellsize) + 1, GRID_MAX_SIDE);
+
+	ncells = (size_t)grid->width * grid->height;
+	grid->cellrank = calloc(ncells, sizeof(grid->cellrank[0]));
+	grid->cellstart = calloc(ncells + 1, sizeof(grid->cellstart[0]));
+	uint32_t *dest = calloc(max(npts, (size_t)1), sizeof(dest[0]));
+	if (grid->cellrank == NULL || grid->cellstart == NULL || dest == NULL ||
+			grid_rank_cells(grid)) {
+		log_error("Failed to allocate the point grid");
+		free(dest);
+		grid_free(grid);
+		return -1;
+	}
+
+	// Counting sort of the points by the rank of their cell
+	for (size_t i = 0; i < npts; i++) {
+		if (!point_is_finite(pts[i])) {
+			dest[i] = UINT32_MAX;
+			continue;
+		}
+		dest[i] = grid->cellrank[grid_cell_y(grid, pts[i].y) * grid->width +
+								 grid_cell_x(grid, pts[i].x)];
+		grid->cellstart[dest[i] + 1]++;
+	}
+	for (size_t i = 0; i < ncells; i++) {
+		grid->nonempty += grid->cellstart[i + 1] > 0;
+		grid->cellstart[i + 1] += grid->cellstart[i];
+	}
+	uint32_t *fill = calloc(ncells, sizeof(fill[0]));
+	if (fill == NULL) {
+		log_error("Failed to allocate the point grid");
+		free(dest);
+		grid_free(grid);
+		return -1;
+	}
+	memcpy(fill, grid->cellstart, ncells * sizeof(fill[0]));
+	size_t nextbad = nfinite;
+	for (size_t i = 0; i < npts; i++) {
+		dest[i] = dest[i] == UINT32_MAX ? nextbad++ : fill[dest[i]]++;
+	}
+	free(fill);
+	if (*follow < npts) {
+		*follow = dest[*follow];
+	}
+
+	// And apply the permutation in place by following its cycles
+	for (size_t i = 0; i < npts; i++) {
+		while (dest[i] != i) {
+			uint32_t j = dest[i];
+			cl_float2 tpt = pts[j];
+			pts[j] = pts[i];
+			pts[i] = tpt;
+			float tval = vals[j];
+			vals[j] = vals[i];
+			vals[i] = tval;
+			dest[i] = dest[j];
+			dest[j] = j;
+		}
+	}
+	free(dest);
+
+	log_info("Built %ux%u point grid with %g cells", grid->width, grid->height,
+			 grid->cellsize);
+	if (grid->cellsize > prefilter / GRID_PREFILTER_CELLS) {
+		log_warn("The point grid cells are larger than a %d. of the prefilter, points up to "
+				 "%g further than it get to the kernels", GRID_PREFILTER_CELLS, grid->cellsize);
+	}
+
+	return 0;
+}
+
+// Most ranges grid_query can return for the rect, one per cell it touches
+size_t grid_query_max(struct grid *grid, struct rect rect)
+{
+	size_t w = grid_cell_x(grid, rect_right(rect)) - grid_cell_x(grid, rect_left(rect)) + 1;
+	size_t h = grid_cell_y(grid, rect_bot(rect)) - grid_cell_y(grid, rect_top(rect)) + 1;
+	return min(w * h, max(grid->nonempty, (size_t)1));
+}
+
+// Returns ranges of the sorted point array covering all cells the rect touches,
+// so points up to grid->cellsize outside of the rect may be included too
+size_t grid_query(struct grid *grid, struct rect rect, cl_uint2 *out)
+{
+	if (rect_right(rect) < rect_left(grid->bounds) ||
+			rect_left(rect) > rect_right(grid->bounds) ||
+			rect_bot(rect) < rect_top(grid->bounds) ||
+			rect_top(rect) > rect_bot(grid->bounds)) {
+		return 0;
+	}
+
+	unsigned int cx0 = grid_cell_x(grid, rect_left(rect));
+	unsigned int cx1 = grid_cell_x(grid, rect_right(rect));
+	unsigned int cy0 = grid_cell_y(grid, rect_top(rect));
+	unsigned int cy1 = grid_cell_y(grid, rect_bot(rect));
+
+	size_t n = 0;
+	for (unsigned int cy = cy0; cy <= cy1; cy++) {
+		for (unsigned int cx = cx0; cx <= cx1; cx++) {
+			uint32_t rank = grid->cellrank[(size_t)cy * grid->width + cx];
+			if (grid->cellstart[rank] == grid->cellstart[rank + 1]) {
+				continue;
+			}
+			out[n].x = grid->cellstart[rank];
+			out[n].y = grid->cellstart[rank + 1];
+			n++;
+		}
+	}
+
+	// Merge the ranges of cells which are adjacent on the curve
+	qsort(out, n, sizeof(out[0]), cmp_ranges);
+	size_t merged = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (merged > 0 && out[merged - 1].y == out[i].x) {
+			out[merged - 1].y = out[i].y;
+		} else {
+			out[merged++] = out[i];
+		}
+	}
+
+	return merged;
+}
+
+void grid_free(struct grid *grid)
+{
+	free(grid->cellrank);
+	free(grid->cellstart);
+	grid->cellrank = NULL;
+	grid->cellstart = NULL;
+}
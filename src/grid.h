@@ -0,0 +1,59 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#ifndef GRID_H
+#define GRID_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <CL/cl.h>
+
+#include "coords.h"
+
+// Uniform grid over the projected input points, used to find the points
+// relevant for a tile without scanning the whole input every time.
+// Building the grid sorts the points along a Morton curve over the cells,
+// so each cell is a contiguous range of the point array and neighbouring
+// cells are mostly neighbours in memory too.
+// The queries return whole cells, so the points up to a cell away from the
+// queried rect get in as well. The cells are kept to a fraction of the
+// prefilter for that, unless the grid would get too large.
+struct grid {
+	struct rect bounds;
+	float cellsize;
+	unsigned int width;
+	unsigned int height;
+	// Cells with any points in them, no query returns more ranges
+	size_t nonempty;
+	uint32_t *cellrank; // Position of each (row-major) cell along the curve
+	uint32_t *cellstart; // width * height + 1 offsets into the sorted points
+};
+
+int grid_build(struct grid *grid, cl_float2 *pts, float *vals, size_t npts,
+			   float prefilter, cl_uint *follow);
+size_t grid_query_max(struct grid *grid, struct rect rect);
+size_t grid_query(struct grid *grid, struct rect rect, cl_uint2 *out);
+void grid_free(struct grid *grid);
+
+#endif
@@ -23,6 +23,8 @@
  * */
 
 #include <argp.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <math.h>
 #include <libgen.h>
@@ -39,88 +41,114 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <CL/cl.h>
-#include <libpng16/png.h>
-#include <json-c/json.h>
 
 #include "blank.h"
 #include "colormaps.h"
+#include "approx.h"
 #include "coords.h"
+#include "cpu.h"
+#include "grid.h"
+#include "manifest.h"
+#include "points.h"
+#include "projection.h"
+#include "transforms.h"
 #include "utils.h"
+#include "writer.h"
 #include "log.h"
 
 #define MAX_SOURCE_SIZE 100000
 #define OCLCHECK(x) if ((x) != CL_SUCCESS) { log_error_clerr("OCL Error!", x); exit(EXIT_FAILURE); }
 #define TILE_SIZE 256
+// The transform order of a zoomlevel is picked from ORDER_SAMPLE_POINTS random
+// points on each of ORDER_SAMPLE_SIDE x ORDER_SAMPLE_SIDE sample metatiles
+#define ORDER_SAMPLE_SIDE 3
+#define ORDER_SAMPLE_POINTS 200
+#define MAX_ZOOM 24
+// Of the headers the kernels include, for hashing them
+#define MAX_INCLUDE_DEPTH 8
+// Number of tiles in flight, while one is being rendered the previous ones
+// are read back and encoded
+#define PIPELINE_DEPTH 3
+#define MAX_DEVICES 16
+// Number of tiles the work-group sizes are benchmarked and the approximation
+// is checked on
+#define SAMPLE_TILES 8
+// Largest metatile side in tiles
+#define MAX_METATILE 16
+// Most tiles rendered by a single launch
+#define MAX_BATCH 64
+// Point ranges each tile of a batch has room for at first, the buffers of
+// a slot grow once its tiles need more
+#define SLOT_RANGES 256
+
+// Per-zoom overrides of the global options, NAN where not given
+struct zoom_params {
+	float range;
+	float prefilter;
+};
 
-void write_png(char *fname, int width, int height, uint8_t *img, rgba_t *colormap)
-{
-	FILE *fout = fopen(fname, "w");
-	if (fout == NULL) {
-		perror("Failed to write a file\n");
-		return;
-	}
-
-	// TODO: Error handling!!!
-	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	png_infop png_info = png_create_info_struct(png_ptr);
-
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		log_error("Error during png creation");
-		return;
-	}
-
-	png_init_io(png_ptr, fout);
-
-	png_colorp colors = calloc(COLORMAP_LEN, sizeof(png_color));
-	png_bytep trns = calloc(COLORMAP_LEN, sizeof(png_color));
-	for (unsigned i = 0; i < COLORMAP_LEN; i++) {
-		colors[i].red = colormap[i].r;
-		colors[i].green = colormap[i].g;
-		colors[i].blue = colormap[i].b;
-		trns[i] = colormap[i].a;
-	}
-
-	png_set_PLTE(png_ptr, png_info, colors, COLORMAP_LEN);
-	png_set_tRNS(png_ptr, png_info, trns, COLORMAP_LEN, NULL);
-	png_set_IHDR(png_ptr, png_info, width, height, 8, PNG_COLOR_TYPE_PALETTE,
-				 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-
-	png_write_info(png_ptr, png_info);
-
-	free(colors);
-	free(trns);
-
-	// TODO: We actually want pallete colors
-	png_bytep rowp = malloc(1 * width * sizeof(png_byte));
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			rowp[x] = img[y * height + x];
-		}
-		png_write_row(png_ptr, rowp);
-	}
-	free(rowp);
-
-	png_write_end(png_ptr, NULL);
+struct device_spec {
+	unsigned int platformid;
+	unsigned int deviceid;
+};
 
-	fclose(fout);
-	png_free_data(png_ptr, png_info, PNG_FREE_ALL, -1);
-	free(png_info);
-	png_destroy_write_struct(&png_ptr, NULL);
-}
+enum backend {
+	BACKEND_OPENCL,
+	BACKEND_CPU,
+	BACKEND_APPROX,
+};
 
 struct arguments {
-	int zoomlevel;
-	unsigned int platformid;
-	unsigned int deviceid;
+	enum backend backend;
+	int zoommin;
+	int zoommax;
+	struct device_spec devices[MAX_DEVICES];
+	size_t ndevices;
+	bool all_devices;
 	char *kernel;
-	char *jspath;
+	char *inpath;
 	char *outdir;
 	char *clargs;
 	struct rect bounds;
 	bool bounds_defined;
 	rgba_t *colormap;
 	projPJ proj_meters;
+	// Definition of proj_meters, the caches are keyed by it
+	char *projdef;
 	float prefilter;
+	struct zoom_params zooms[MAX_ZOOM + 1];
+	long encode_threads;
+	bool tune;
+	bool approx_check;
+	unsigned int metatile;
+	unsigned int batch;
+	bool force;
+	// TRANSFORM_AFFINE or TRANSFORM_QUADRATIC, 0 to pick the lowest order
+	// which stays within transform_error pixels
+	int transform_order;
+	float transform_error;
+	bool host_projection;
+	// KERNEL_PROJECTION_NONE unless the OpenCL kernels project on their own
+	struct kernel_projection kproj;
+	// The points and pixels stay in WGS84, the kernels measure the distances
+	// along the great circle instead of in proj_meters
+	bool great_circle;
+};
+
+// Keys of the options without a short variant
+enum {
+	OPT_ENCODE_THREADS = 0x100,
+	OPT_DEVICES,
+	OPT_BACKEND,
+	OPT_TUNE,
+	OPT_APPROX_CHECK,
+	OPT_METATILE,
+	OPT_BATCH,
+	OPT_FORCE,
+	OPT_TRANSFORM_ORDER,
+	OPT_TRANSFORM_ERROR,
+	OPT_HOST_PROJECTION,
+	OPT_GREAT_CIRCLE,
 };
 
 const char *argp_program_version = "cl-heatmap 1.0";
@@ -128,16 +156,29 @@ const char *argp_program_bug_address = "<atx@atx.name>";
 static const char argp_doc[] = "TODO";
 
 static struct argp_option argp_opts[] = {
-	{ "zoom",		'z',	"ZOOM",			0,	"Zoomlevel", 0 },
+	{ "zoom",		'z',	"ZOOM",			0,	"Zoomlevel or a range of them (-z 10-16)", 0 },
 	{ "kernel",	'k',	"KERNEL",		0,	"Kernel to use", 0 },
 	{ "outdir",	'o',	"OUTDIR",		0,	"Output directory", 0 },
-	{ "input",	'i',	"INPUT",		0,	"Input JSON", 0 },
+	{ "input",	'i',	"INPUT",		0,	"Input JSON, Safecast CSV or converted point file", 0 },
 	{ "clargs",	'c',	"CLARGS",		0,	"OpenCL compiler arguments", 0 },
 	{ "colormap",	'm',	"COLORMAP",		0,	"Colormap to use, available: [\"heat\"]", 0 },
 	{ "boundaries",'b',	"BOUNDARIES",	0,	"Boundaries in WGS84 '50.12,14.23,51.23,15.33'", 0 },
 	{ "device",	'd',	"DEVICE",		0,	"OpenCL device to use (-d 0.0)", 0 },
+	{ "backend", OPT_BACKEND, "BACKEND", 0, "Render with 'opencl' (default), on the 'cpu' (heat, density and tdoa kernels) or 'approx'imate the heat and density kernels on the CPU", 0 },
+	{ "approx-check", OPT_APPROX_CHECK, NULL, 0, "Measure the error of the approximation against the exact kernel on sample tiles", 0 },
+	{ "tune", OPT_TUNE, NULL, 0, "Benchmark the work-group sizes on sample tiles and save the fastest to the device profile", 0 },
+	{ "devices", OPT_DEVICES, "DEVICES", 0, "Render on several OpenCL devices at once, 'all' or a list (--devices 0.0,1.0)", 0 },
 	{ "projection",'p',	"PROJECTION",	0,	"Proj4 specification of the cartesian projection (default=\"+init=epsg:3045\")", 0 },
 	{ "prefilter", 'f', "PREFILTER",	0,	"Do not pass a point to the kernel if it is further than PREFILTER", 0 },
+	{ "zoom-table",'t',	"TABLE",		0,	"Per-zoom RANGE and PREFILTER 'ZOOM:RANGE:PREFILTER,...', either may be left empty", 0 },
+	{ "metatile", OPT_METATILE, "N", 0, "Render NxN tiles in a single launch and slice them afterwards, N is a power of two (default=1)", 0 },
+	{ "batch", OPT_BATCH, "N", 0, "Render up to N (meta)tiles in a single OpenCL launch (default=1)", 0 },
+	{ "force", OPT_FORCE, NULL, 0, "Render all the tiles, even those the manifest has as unchanged", 0 },
+	{ "host-projection", OPT_HOST_PROJECTION, NULL, 0, "Project with proj4 on the host even where the OpenCL kernels could do it exactly", 0 },
+	{ "great-circle", OPT_GREAT_CIRCLE, NULL, 0, "Measure great circle distances in WGS84 instead of projecting the points (OpenCL heat and tdoa kernels)", 0 },
+	{ "transform-order", OPT_TRANSFORM_ORDER, "ORDER", 0, "Order of the tile to cartesian transforms, 1 (affine), 2 (quadratic) or 'auto' to pick the lowest one within --transform-error (default)", 0 },
+	{ "transform-error", OPT_TRANSFORM_ERROR, "PIXELS", 0, "Largest error of the tile transforms 'auto' accepts (default=0.25)", 0 },
+	{ "encode-threads", OPT_ENCODE_THREADS, "N", 0, "Number of threads encoding the PNG tiles (default=number of CPUs)", 0 },
 	{ NULL,		0,		NULL,			0,	NULL, 0 }
 };
 
@@ -188,10 +229,59 @@ static double safe_parse_double(struct argp_state *state, char *name, char *arg)
 	return ret;
 }
 
-static void parse_device(char *arg, struct argp_state *state)
+static void parse_zoom(char *arg, struct argp_state *state)
+{
+	struct arguments *arguments = state->input;
+	char *sep = strchr(arg, '-');
+
+	if (sep != NULL) {
+		*sep = '\0';
+		arguments->zoommin = safe_parse_long(state, "ZOOM", arg);
+		arguments->zoommax = safe_parse_long(state, "ZOOM", sep + 1);
+	} else {
+		arguments->zoommin = arguments->zoommax = safe_parse_long(state, "ZOOM", arg);
+	}
+	if (arguments->zoommin < 0 || arguments->zoommax > MAX_ZOOM ||
+			arguments->zoommin > arguments->zoommax) {
+		argp_error(state, "Zoomlevels have to be within 0-%d!", MAX_ZOOM);
+	}
+}
+
+static void parse_zoom_table(char *arg, struct argp_state *state)
 {
 	struct arguments *arguments = state->input;
-	unsigned int *ids[] = { &arguments->platformid, &arguments->deviceid };
+	char *save;
+
+	for (char *entry = strtok_r(arg, ",", &save); entry != NULL;
+			entry = strtok_r(NULL, ",", &save)) {
+		// strtok would merge the empty fields
+		char *range = strchr(entry, ':');
+		char *prefilter = range != NULL ? strchr(range + 1, ':') : NULL;
+		if (prefilter == NULL) {
+			argp_error(state, "Error while parsing zoom table entry '%s'!", entry);
+			return;
+		}
+		*range++ = '\0';
+		*prefilter++ = '\0';
+
+		long zoom = safe_parse_long(state, "ZOOM", entry);
+		if (zoom < 0 || zoom > MAX_ZOOM) {
+			argp_error(state, "Zoomlevels have to be within 0-%d!", MAX_ZOOM);
+			return;
+		}
+		if (*range != '\0') {
+			arguments->zooms[zoom].range = safe_parse_double(state, "RANGE", range);
+		}
+		if (*prefilter != '\0') {
+			arguments->zooms[zoom].prefilter =
+				safe_parse_double(state, "PREFILTER", prefilter);
+		}
+	}
+}
+
+static void parse_device(char *arg, struct argp_state *state, struct device_spec *spec)
+{
+	unsigned int *ids[] = { &spec->platformid, &spec->deviceid };
 	char *save;
 
 	for (size_t i = 0; i < ARRAY_SIZE(ids); i++, arg = NULL) {
@@ -203,12 +293,35 @@ static void parse_device(char *arg, struct argp_state *state)
 	}
 }
 
+static void parse_devices(char *arg, struct argp_state *state)
+{
+	struct arguments *arguments = state->input;
+	char *save;
+
+	arguments->all_devices = !strcmp(arg, "all");
+	if (arguments->all_devices) {
+		return;
+	}
+	arguments->ndevices = 0;
+	for (char *tok = strtok_r(arg, ",", &save); tok != NULL;
+			tok = strtok_r(NULL, ",", &save)) {
+		if (arguments->ndevices == ARRAY_SIZE(arguments->devices)) {
+			argp_error(state, "At most %d devices can be used!", MAX_DEVICES);
+			return;
+		}
+		parse_device(tok, state, &arguments->devices[arguments->ndevices++]);
+	}
+	if (arguments->ndevices == 0) {
+		argp_error(state, "Error while parsing device specification!");
+	}
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
 	struct arguments *arguments = state->input;
 	switch (key) {
 		case 'z':
-			arguments->zoomlevel = safe_parse_long(state, "ZOOM", arg);
+			parse_zoom(arg, state);
 			break;
 		case 'k':
 			arguments->kernel = arg;
@@ -217,7 +330,7 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 			arguments->outdir = arg;
 			break;
 		case 'i':
-			arguments->jspath = arg;
+			arguments->inpath = arg;
 			break;
 		case 'c':
 			arguments->clargs = arg;
@@ -235,7 +348,38 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 			parse_opt_boundaries(arg, state);
 			break;
 		case 'd':
-			parse_device(arg, state);
+			parse_device(arg, state, &arguments->devices[0]);
+			arguments->ndevices = 1;
+			arguments->all_devices = false;
+			break;
+		case OPT_DEVICES:
+			parse_devices(arg, state);
+			break;
+		case OPT_TUNE:
+			arguments->tune = true;
+			break;
+		case OPT_APPROX_CHECK:
+			arguments->approx_check = true;
+			break;
+		case OPT_FORCE:
+			arguments->force = true;
+			break;
+		case OPT_HOST_PROJECTION:
+			arguments->host_projection = true;
+			break;
+		case OPT_GREAT_CIRCLE:
+			arguments->great_circle = true;
+			break;
+		case OPT_BACKEND:
+			if (!strcmp(arg, "opencl")) {
+				arguments->backend = BACKEND_OPENCL;
+			} else if (!strcmp(arg, "cpu")) {
+				arguments->backend = BACKEND_CPU;
+			} else if (!strcmp(arg, "approx")) {
+				arguments->backend = BACKEND_APPROX;
+			} else {
+				argp_error(state, "Unknown backend specified!");
+			}
 			break;
 		case 'p':
 			arguments->proj_meters = pj_init_plus(arg);
@@ -246,6 +390,49 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		case 'f':
 			arguments->prefilter = safe_parse_double(state, "PREFILTER", arg);
 			break;
+		case 't':
+			parse_zoom_table(arg, state);
+			break;
+		case OPT_METATILE: {
+			long metatile = safe_parse_long(state, "N", arg);
+			if (metatile < 1 || metatile > MAX_METATILE || (metatile & (metatile - 1))) {
+				argp_error(state, "The metatile size has to be a power of two up to %d!",
+						   MAX_METATILE);
+			}
+			arguments->metatile = metatile;
+			break;
+		}
+		case OPT_BATCH: {
+			long batch = safe_parse_long(state, "N", arg);
+			if (batch < 1 || batch > MAX_BATCH) {
+				argp_error(state, "The batch size has to be within 1-%d!", MAX_BATCH);
+			}
+			arguments->batch = batch;
+			break;
+		}
+		case OPT_TRANSFORM_ORDER:
+			if (!strcmp(arg, "auto")) {
+				arguments->transform_order = 0;
+			} else {
+				long order = safe_parse_long(state, "ORDER", arg);
+				if (order != TRANSFORM_AFFINE && order != TRANSFORM_QUADRATIC) {
+					argp_error(state, "The transform order has to be 1, 2 or 'auto'!");
+				}
+				arguments->transform_order = order;
+			}
+			break;
+		case OPT_TRANSFORM_ERROR:
+			arguments->transform_error = safe_parse_double(state, "PIXELS", arg);
+			if (!(arguments->transform_error > 0.0f)) {
+				argp_error(state, "The transform error has to be positive!");
+			}
+			break;
+		case OPT_ENCODE_THREADS:
+			arguments->encode_threads = safe_parse_long(state, "N", arg);
+			if (arguments->encode_threads < 1) {
+				argp_error(state, "There has to be at least one encode thread!");
+			}
+			break;
 		default:
 			return ARGP_ERR_UNKNOWN;
 	}
@@ -254,36 +441,291 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 
 static struct argp argp = { argp_opts, parse_opt, NULL, argp_doc, NULL, NULL, NULL };
 
-static void fetch_tile_transform(int z, int x, int y, char *cachedir,
-								 projPJ proj_meters, cl_float4 *out)
+// Whether the transform in the store is yet to be computed, a zero
+// transform would collapse the tile into a single point
+static bool transform_missing(const cl_float8 *tr)
 {
-	char dirpath[PATH_MAX];
-	snprintf(dirpath, sizeof(dirpath),
-			"%s/%d/%d", cachedir, z, x);
+	return tr[0].s[0] == 0.0f && tr[0].s[1] == 0.0f && tr[1].s[0] == 0.0f && tr[1].s[1] == 0.0f;
+}
+
+// Computes the transforms of the tiles from left, top to right, bot
+// (exclusive) missing in the store, on all the cores
+static int fill_transform_store(struct transform_store *ts, unsigned int left,
+								unsigned int top, unsigned int right, unsigned int bot,
+								projPJ proj_meters, size_t *ngenerated)
+{
+	cl_uint2 *missing = malloc(max((size_t)(right - left) * (bot - top), (size_t)1) *
+							   sizeof(missing[0]));
+	if (missing == NULL) {
+		log_error("Failed to allocate the missing tile transforms");
+		return -1;
+	}
+	size_t nmissing = 0;
+	for (unsigned int x = left; x < right; x++) {
+		for (unsigned int y = top; y < bot; y++) {
+			if (transform_missing(transform_store_get(ts, x, y))) {
+				missing[nmissing++] = (cl_uint2){ .x = x, .y = y };
+			}
+		}
+	}
+
+	cl_float8 *generated = malloc(max(nmissing, (size_t)1) * 2 * sizeof(generated[0]));
+	if (generated == NULL) {
+		log_error("Failed to allocate the missing tile transforms");
+		free(missing);
+		return -1;
+	}
+	int ret = generate_translation_tiles(ts->zoom, ts->order, missing, nmissing, generated,
+										 proj_meters);
+	if (ret == 0) {
+		for (size_t i = 0; i < nmissing; i++) {
+			memcpy(transform_store_get(ts, missing[i].x, missing[i].y), &generated[2 * i],
+				   2 * sizeof(generated[0]));
+		}
+		*ngenerated = nmissing;
+	}
+	free(generated);
+	free(missing);
+	return ret;
+}
+
+static void log_build_failure(cl_program clprg, cl_device_id devid, cl_int ret)
+{
+	log_error_clerr("Kernel build failed, dumping compiler output", ret);
+	size_t len;
+	clGetProgramBuildInfo(clprg, devid, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
+	char msg[len];
+	clGetProgramBuildInfo(clprg, devid, CL_PROGRAM_BUILD_LOG, len, msg, NULL);
+	fprintf(stderr, "%s\n", msg);
+}
+
+// Projects the WGS84 points in place with kernels/project.cl, which is
+// compiled with the same projection as the rendering kernels
+static int project_points_device(struct arguments *args, cl_device_id devid,
+								 const char *kdir, cl_float2 *pts, size_t npts)
+{
+	if (npts == 0) {
+		return 0;
+	}
+
 	char path[PATH_MAX];
-	snprintf(path, sizeof(path),
-			"%s/%d.map", dirpath, y);
-	FILE *file = fopen(path, "r");
-	// TODO: Maybe add more error checks?
-	if (file == NULL) {
-		generate_translation_tile(x, y, z, out, proj_meters);
-		int ret = mkdir_recursive(dirpath, S_IRWXU);
-		if (ret < 0) {
-			log_error_errno("Failed to mkdir %s", dirpath);
+	snprintf(path, sizeof(path), "%s/project.cl", kdir);
+	char *src;
+	size_t srclen;
+	if (file_read_whole(path, &src, &srclen)) {
+		log_error_errno("Failed to load %s", path);
+		return -1;
+	}
+	char compargs[2000];
+	snprintf(compargs, sizeof(compargs), "-I%s", kdir);
+	if (kernel_projection_args(&args->kproj, compargs, sizeof(compargs))) {
+		log_error("The projection does not fit into the compiler arguments");
+		free(src);
+		return -1;
+	}
+
+	cl_int ret;
+	cl_context clctx = clCreateContext(NULL, 1, &devid, NULL, NULL, &ret);
+	OCLCHECK(ret);
+	cl_command_queue clque = clCreateCommandQueue(clctx, devid, 0, &ret);
+	OCLCHECK(ret);
+	cl_program clprg = clCreateProgramWithSource(clctx, 1, (const char **)&src, &srclen, &ret);
+	OCLCHECK(ret);
+	free(src);
+	ret = clBuildProgram(clprg, 1, &devid, compargs, NULL, NULL);
+	if (ret != CL_SUCCESS) {
+		log_build_failure(clprg, devid, ret);
+		clReleaseProgram(clprg);
+		clReleaseCommandQueue(clque);
+		clReleaseContext(clctx);
+		return -1;
+	}
+	cl_kernel clkrn = clCreateKernel(clprg, "project_points", &ret);
+	OCLCHECK(ret);
+	cl_mem pts_cl = clCreateBuffer(clctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+								   npts * sizeof(cl_float2), pts, &ret);
+	OCLCHECK(ret);
+	ret = clSetKernelArg(clkrn, 0, sizeof(pts_cl), &pts_cl);
+	OCLCHECK(ret);
+	size_t global = npts;
+	ret = clEnqueueNDRangeKernel(clque, clkrn, 1, NULL, &global, NULL, 0, NULL, NULL);
+	OCLCHECK(ret);
+	ret = clEnqueueReadBuffer(clque, pts_cl, CL_TRUE, 0, npts * sizeof(cl_float2), pts,
+							  0, NULL, NULL);
+	OCLCHECK(ret);
+
+	clReleaseMemObject(pts_cl);
+	clReleaseKernel(clkrn);
+	clReleaseProgram(clprg);
+	clReleaseCommandQueue(clque);
+	clReleaseContext(clctx);
+	return 0;
+}
+
+// Now we attempt to filter out points which are too far away to make
+// any difference for the tile values. The corners come from the tile
+// transform, which is what the kernels see the tile as anyway.
+static struct rect tile_bounds_meters(const cl_float8 *tr, float prefilter)
+{
+	struct rect tilet = rect_make((cl_float2){ .x = 0, .y = 0 },
+								  (cl_float2){ .x = 1, .y = 1 });
+	// Okay, so we can't just transform the left-top and right-bottom corners
+	// here and call it a day as the tile->meters coordinate transformation
+	// would need to have axis in the same direction.
+	// As we don't care about some extra points being included, we
+	// just take the maximum boundary.
+	cl_float2 ptstile[4] = {
+		rect_lefttop(tilet), rect_righttop(tilet),
+		rect_rightbot(tilet), rect_leftbot(tilet),
+	};
+	cl_float2 ptsms[4];
+	for (size_t i = 0; i < ARRAY_SIZE(ptsms); i++) {
+		ptsms[i] = (cl_float2){
+			.x = tr[0].s[0] * ptstile[i].x + tr[0].s[1] * ptstile[i].y + tr[0].s[2],
+			.y = tr[1].s[0] * ptstile[i].x + tr[1].s[1] * ptstile[i].y + tr[1].s[2],
+		};
+	}
+	struct rect tilems = rect_max(ptsms, ARRAY_SIZE(ptsms));
+	// Each of the quadratic terms stays between zero and its coefficient
+	// within the tile, which bounds how far they can move the affine corners
+	for (int i = 3; i < TRANSFORM_TERMS; i++) {
+		tilems.lt.x += min(tr[0].s[i], 0.0f);
+		tilems.rb.x += max(tr[0].s[i], 0.0f);
+		tilems.lt.y += min(tr[1].s[i], 0.0f);
+		tilems.rb.y += max(tr[1].s[i], 0.0f);
+	}
+	return rect_inflate(tilems, prefilter);
+}
+
+// Zoomlevel of the tile the projected points are checked against
+#define FRAME_CHECK_ZOOM 12
+
+// Makes sure the points got projected into the frame of the tile transforms,
+// by checking that the first one lands within the bounds of its own tile
+static int check_projected_frame(struct arguments *args, const cl_float2 *wgs,
+								 const cl_float2 *pts, size_t npts)
+{
+	for (size_t i = 0; i < npts; i++) {
+		// Past the latitudes of the tiles, the point has no tile to check with
+		if (!isfinite(pts[i].x) || !isfinite(pts[i].y) || fabsf(wgs[i].x) > 85.0f) {
+			continue;
 		}
-		FILE *fout = fopen(path, "w");
-		if (fout == NULL) {
-			log_error_errno("Failed to save tile transform cache file %s", path);
-			return;
+		cl_float2 tile = wgs84_to_tile(wgs[i], FRAME_CHECK_ZOOM);
+		cl_float8 tr[2];
+		generate_translation_tile(tile.x, tile.y, FRAME_CHECK_ZOOM, TRANSFORM_AFFINE, tr,
+								  args->proj_meters);
+		// Some slack for the fit and the rounding to floats
+		float side = sqrtf(fabsf(tr[0].s[0] * tr[1].s[1] - tr[0].s[1] * tr[1].s[0]));
+		struct rect bounds = tile_bounds_meters(tr, 0.01f * side + 1.0f);
+		if (!rect_is_inside(bounds, pts[i])) {
+			log_error("The point (%f, %f) got projected to (%f, %f), outside of its tile "
+					  "from (%f, %f) to (%f, %f)", wgs[i].x, wgs[i].y, pts[i].x, pts[i].y,
+					  rect_left(bounds), rect_top(bounds), rect_right(bounds),
+					  rect_bot(bounds));
+			return -1;
 		}
-		log_info("Generated cache file %s", path);
-		fwrite(out, sizeof(out[0]), 2, fout);
-		fclose(fout);
-	} else {
-		log_info("Loaded cache file %s", path);
-		fread(out, sizeof(out[0]), 2, file);
-		fclose(file);
+		return 0;
+	}
+	return 0;
+}
+
+// Loads the input points projected with proj_meters, on the device if the
+// kernels can do the projection. Projecting a large input takes a while, so
+// the projected points are cached in cachedir, keyed by the input path and
+// the projection. An entry is considered stale once the size or the
+// modification time of the input changes. With great circle distances, the
+// points are only converted to radians, which is not worth caching.
+static int fetch_points(struct arguments *args, cl_device_id devid, const char *kdir,
+						struct points *points)
+{
+	const char *inpath = args->inpath;
+	const char *cachedir = args->outdir;
+	const char *projdef = args->projdef;
+
+	if (args->great_circle) {
+		// Without a projection, the converted files give their WGS84 points
+		if (points_load(inpath, NULL, points)) {
+			return -1;
+		}
+		log_info("Loaded %zu points from %s", points->len, inpath);
+		for (size_t i = 0; i < points->len; i++) {
+			points->pts[i].x *= M_PI / 180.0;
+			points->pts[i].y *= M_PI / 180.0;
+		}
+		return 0;
+	}
+
+	struct stat src;
+	if (stat(inpath, &src)) {
+		log_error_errno("Failed to stat the input file %s", inpath);
+		return -1;
+	}
+
+	char realin[PATH_MAX];
+	if (realpath(inpath, realin) == NULL) {
+		strlcpy(realin, inpath, sizeof(realin));
+	}
+	uint64_t key = hash_str(hash_str(HASH_INIT, realin), projdef);
+	char dirpath[PATH_MAX];
+	snprintf(dirpath, sizeof(dirpath), "%s/points", cachedir);
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%016" PRIx64 ".bin", dirpath, key);
+
+	if (access(path, R_OK) == 0 && points_load_binary(path, projdef, points) == 0) {
+		if (points->projected && points->srcsize == (uint64_t)src.st_size &&
+				points->srcmtime == stat_mtime_ns(&src)) {
+			log_info("Loaded cached points %s", path);
+			return 0;
+		}
+		log_info("Cached points %s are stale, rebuilding", path);
+		points_free(points);
+	}
+
+	if (points_load(inpath, projdef, points)) {
+		return -1;
+	}
+	log_info("Loaded %zu points from %s", points->len, inpath);
+	if (points->projected) {
+		// Converted with the same projection already, nothing to cache
+		log_info("Using the pre-projected points from %s", inpath);
+		return 0;
+	}
+
+	// Keep the WGS84 coordinates around for the cache file
+	cl_float2 *wgs = malloc(max(points->len, (size_t)1) * sizeof(wgs[0]));
+	if (wgs == NULL) {
+		log_error("Failed to allocate memory for %zu points", points->len);
+		return -1;
+	}
+	memcpy(wgs, points->pts, points->len * sizeof(wgs[0]));
+
+	double tproj = time_monotonic();
+	int ret = args->kproj.type != KERNEL_PROJECTION_NONE ?
+		project_points_device(args, devid, kdir, points->pts, points->len) :
+		wgs84_to_meters_array(points->pts, points->len, args->proj_meters);
+	if (ret || check_projected_frame(args, wgs, points->pts, points->len)) {
+		free(wgs);
+		return -1;
 	}
+	points->projected = true;
+	log_info("Projected the points %s in %.3fs",
+			 args->kproj.type != KERNEL_PROJECTION_NONE ? "on the device" : "with proj4",
+			 time_monotonic() - tproj);
+
+	struct points wgspoints = {
+		.len = points->len,
+		.pts = wgs,
+		.vals = points->vals,
+	};
+	char mkpath[PATH_MAX];
+	strlcpy(mkpath, dirpath, sizeof(mkpath));
+	if (mkdir_recursive(mkpath, S_IRWXU) == 0 &&
+			points_save_binary(path, &wgspoints, points->pts, projdef, &src) == 0) {
+		log_info("Saved the projected points to %s", path);
+	}
+	free(wgs);
+
+	return 0;
 }
 
 static char *load_kernel(const char *name, char **retpath)
@@ -334,299 +776,1909 @@ static char *load_kernel(const char *name, char **retpath)
 }
 
 
-int main(int argc, char *argv[])
-{
-	struct arguments args = {
-		.zoomlevel = 12,
-		.platformid = 0,
-		.deviceid = 0,
-		.kernel = NULL,
-		.jspath = "./input.json",
-		.outdir = "./cache",
-		.clargs = "",
-		.bounds_defined = false,
-		.colormap = colormap_heat,
-		.proj_meters = NULL,
-		.prefilter = INFINITY
-	};
+// Everything needed for rendering tiles on the OpenCL device
+// Device and host buffers of a single tile in flight
+struct tile_slot {
+	// An image array when rendering batches of tiles
+	cl_mem tile_cl;
+	cl_mem ranges_cl;
+	// Per-tile transforms and ranges of a batch, NULL without batches
+	cl_mem trx_cl;
+	cl_mem try_cl;
+	cl_mem batch_cl;
+	// Sums of the point footprints for kernels with a splat_points pass
+	cl_mem accum_cl;
+	// The ranges of all the tiles of the batch, one after another
+	cl_uint2 *ranges;
+	cl_uint nranges;
+	// Capacity of ranges and ends, and of ranges_cl and ends_cl, which catch
+	// up when the slot gets bound
+	size_t rangescap;
+	size_t clrangescap;
+	// Points of the tile up to and including each of the ranges, for the
+	// splat_points pass to find the point of each work-item
+	cl_uint *ends;
+	cl_mem ends_cl;
+	// Point count of the tile with the most of them
+	cl_uint maxpts;
+	// The tiles of the batch, which are not empty
+	struct tile_job *jobs[MAX_BATCH];
+	cl_float8 trx[MAX_BATCH];
+	cl_float8 try[MAX_BATCH];
+	// First range of each tile and their count
+	cl_uint2 batch[MAX_BATCH];
+	size_t njobs;
+	// Non-NULL while the batch is in flight, handed over to the writer after
+	uint8_t *tile;
+	// Completion of the readback into tile
+	cl_event done;
+};
 
-	argp_parse(&argp, argc, argv, 0, 0, &args);
+// Metatiles of a zoomlevel, shared by all the devices
+struct tile_job {
+	// The top left tile of the metatile
+	unsigned int tx;
+	unsigned int ty;
+	// Transform of the whole metatile
+	cl_float8 tr[2];
+	// Area of the points passed to the kernel
+	struct rect bounds;
+	// Of the inputs of the tile, 0 for empty tiles
+	uint64_t hash;
+	// Tiles of the job which could not be written, updated atomically as the
+	// writer threads add theirs
+	int failed;
+};
 
-	if (args.kernel == NULL) {
-		fprintf(stderr, "No kernel specified. Select on from the kernels/ directory!\n");
-		return EXIT_FAILURE;
-	}
+struct tile_queue {
+	int zoom;
+	// Side of the metatiles in tiles
+	unsigned int metatile;
+	// The tiles to write, right and bottom exclusive. Metatiles on the edges
+	// cover some tiles outside of the area as well.
+	unsigned int left, top, right, bot;
+	// Hash of the kernel, its arguments and the colormap
+	uint64_t confighash;
+	// The tiles as rendered by the earlier runs
+	const struct manifest *manifest;
+	struct tile_job *jobs;
+	size_t len;
+	// Index of the next tile to hand out, each device takes the next one as
+	// soon as it has a free slot, so the faster ones end up with more tiles
+	size_t next;
+};
 
-	if (!args.bounds_defined) {
-		fprintf(stderr, "No boundaries specified!\n");
-		return EXIT_FAILURE;
-	}
+// Counts of (meta)tiles
+struct render_stats {
+	size_t rendered;
+	// Unchanged since the last run
+	size_t skipped;
+	// Rendered by the last run, but empty now
+	size_t removed;
+};
 
-	init_projs();
+// Everything needed to render on a single device, or on one thread of the
+// CPU backend
+struct render_ctx {
+	unsigned int index;
+	enum backend backend;
+	struct arguments *args;
+	pthread_t thread;
+	bool started;
+	cl_device_id devid;
+	char devname[500];
+	cl_context clctx;
+	cl_command_queue clque;
+	const char *clsrc;
+	const char *kdir;
+	// Hash of the kernel sources, the device and its driver
+	uint64_t prghash;
+	// The program is rebuilt whenever a zoomlevel needs different arguments
+	char compargs[2000];
+	// Side of the metatiles of the zoomlevel in pixels
+	int tilesize;
+	// Tiles per launch, always one on the CPU
+	size_t batch;
+	cl_program clprg;
+	cl_kernel clkrn;
+	// NULL unless the kernel splats the points before generate_pixel
+	cl_kernel splatkrn;
+	size_t local_work_size[3];
+	// Whether --tune already ran on this device
+	bool tuned;
+	cl_mem pts_cl;
+	cl_mem vals_cl;
+	// The CPU backend renders right away from the host points, it only uses
+	// the ranges of the first slot
+	struct cpu_kernel cpukrn;
+	struct approx_kernel approxkrn;
+	const cl_float2 *pts;
+	const float *vals;
+	struct tile_slot slots[PIPELINE_DEPTH];
+	unsigned nextslot;
+	struct tile_writer *writer;
+	size_t datalen;
+	// NULL if all the points are passed to every tile
+	struct grid *grid;
+	// Where the grid moved the first input point, see TILE_ARGS
+	cl_uint refpt;
+	char blankfilepath[PATH_MAX];
+	struct tile_queue *queue;
+	// Per zoomlevel statistics
+	double tquery;
+	size_t ntiles;
+	struct render_stats stats;
+	int status;
+};
 
-	// Parse the input JSON
-	char *jsonstr;
-	if (file_read_whole(args.jspath, &jsonstr, NULL)) {
-		log_error_errno("Failed to read the input JSON file %s", args.jspath);
-		return EXIT_FAILURE;
-	}
-	struct json_object *jroot = json_tokener_parse(jsonstr);
-	struct json_object *jpts;
-	if (!json_object_object_get_ex(jroot, "points", &jpts)) {
-		log_error("Key \"points\" not found in the input file");
-		return EXIT_FAILURE;
-	}
-	size_t datalen = json_object_array_length(jpts);
-	cl_float2 *datapts = calloc(datalen, sizeof(cl_float2));
-	float *datavals = calloc(datalen, sizeof(float));
-	for (unsigned int i = 0; i < datalen; i++) {
-		json_object *jpt = json_object_array_get_idx(jpts, i);
-		json_object *jloc;
-		json_object_object_get_ex(jpt, "loc", &jloc);
-		json_object *jval;
-		json_object_object_get_ex(jpt, "val", &jval);
-		json_object *jlat = json_object_array_get_idx(jloc, 0);
-		json_object *jlng = json_object_array_get_idx(jloc, 1);
-		datapts[i].x = json_object_get_double(jlat);
-		datapts[i].y = json_object_get_double(jlng);
-		datavals[i] = json_object_get_double(jval);
-	}
+static float zoom_prefilter(struct arguments *args, int zoom)
+{
+	float prefilter = args->zooms[zoom].prefilter;
+	return isnan(prefilter) ? args->prefilter : prefilter;
+}
 
-	log_info("Loaded %ld points", datalen);
+// Metatiles cannot be larger than the whole zoomlevel
+static unsigned int zoom_metatile(struct arguments *args, int zoom)
+{
+	return min(args->metatile, 1u << zoom);
+}
 
-	if (args.proj_meters == NULL) {
-		args.proj_meters = pj_init_plus("+init=epsg:3045");
+// Hashes the kernel source together with the headers it includes from kdir,
+// and the headers those include in turn
+static uint64_t hash_kernel_includes(uint64_t hash, const char *clsrc, const char *kdir,
+									 int depth)
+{
+	hash = hash_str(hash, clsrc);
+	if (depth >= MAX_INCLUDE_DEPTH) {
+		return hash;
 	}
 
-	for (unsigned int i = 0; i < datalen; i++) {
-		datapts[i] = wgs84_to_meters(datapts[i], args.proj_meters);
+	for (const char *line = clsrc; line != NULL; line = strchr(line, '\n')) {
+		char name[PATH_MAX];
+		line += *line == '\n';
+		if (sscanf(line, " #include \"%1023[^\"]\"", name) != 1) {
+			continue;
+		}
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", kdir, name);
+		char *data;
+		size_t len;
+		if (file_read_whole(path, &data, &len) == 0) {
+			char *str = realloc(data, len + 1);
+			if (str != NULL) {
+				str[len] = '\0';
+				hash = hash_kernel_includes(hash, str, kdir, depth + 1);
+				data = str;
+			}
+			free(data);
+		}
 	}
 
-	struct rect tilebounds = rect_make(
-			wgs84_to_tile(args.bounds.lt, args.zoomlevel),
-			wgs84_to_tile(args.bounds.rb, args.zoomlevel));
-	tilebounds.lt = round_point(tilebounds.lt, 1, false);
-	tilebounds.rb = round_point(tilebounds.rb, 1, true);
-
-	// Render tiles
-	log_info("Rendering tiles from (%d,%d) to (%d,%d) on zoomlevel %d",
-			 (int)rect_left(tilebounds), (int)rect_top(tilebounds),
-			 (int)rect_right(tilebounds), (int)rect_bot(tilebounds),
-			 args.zoomlevel);
+	return hash;
+}
 
+static uint64_t hash_kernel_source(const char *clsrc, const char *kdir)
+{
+	return hash_kernel_includes(HASH_INIT, clsrc, kdir, 0);
+}
 
-	char zpath[PATH_MAX];
-	snprintf(zpath, sizeof(zpath), "%s/%d", args.outdir, args.zoomlevel);
-	mkdir(zpath, 0755);
+static void program_cache_path(struct render_ctx *rc, const char *compargs,
+							   char *path, size_t len)
+{
+	uint64_t key = hash_str(rc->prghash, compargs);
+	snprintf(path, len, "%s/programs/%016" PRIx64 ".bin", rc->args->outdir, key);
+}
 
-	log_warn("Starting OpenCL!");
-	log_debug("Attempting to use platform = %d and device = %d", args.platformid, args.deviceid);
+// Tries to load a program binary cached by an earlier run
+static cl_program load_cached_program(struct render_ctx *rc, const char *compargs)
+{
+	char path[PATH_MAX];
+	program_cache_path(rc, compargs, path, sizeof(path));
 
-	// Initialize OpenCL
-	cl_platform_id pids[10];
-	cl_uint cnt;
-	clGetPlatformIDs(ARRAY_SIZE(pids), pids, &cnt);
-	if (args.platformid > cnt - 1) {
-		log_error("Platform id = %d not found!", args.platformid);
-		exit(EXIT_FAILURE);
+	char *data;
+	size_t len;
+	if (file_read_whole(path, &data, &len)) {
+		return NULL;
 	}
-	cl_platform_id platform = pids[args.platformid];
-	char platname[500];
-	clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(platname), platname, NULL);
-	char platver[500];
-	clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(platver), platver, NULL);
-	log_info("OpenCL Platform %s  %s", platname, platver);
 
-	cl_device_id dids[10];
-	clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, ARRAY_SIZE(dids), dids, &cnt);
-	if (args.deviceid > cnt - 1) {
-		log_error("Device id = %d not found!", args.deviceid);
-		exit(EXIT_FAILURE);
+	cl_int ret, status;
+	cl_program clprg = clCreateProgramWithBinary(rc->clctx, 1, &rc->devid, &len,
+												 (const unsigned char **)&data,
+												 &status, &ret);
+	free(data);
+	if (ret != CL_SUCCESS || status != CL_SUCCESS) {
+		log_warn("Ignoring unusable cached program %s", path);
+		if (ret == CL_SUCCESS) {
+			clReleaseProgram(clprg);
+		}
+		return NULL;
 	}
-	cl_device_id *devid = &dids[args.deviceid];
-	char devname[500];
-	clGetDeviceInfo(*devid, CL_DEVICE_NAME, sizeof(devname), devname, NULL);
-	char devver[500];
-	clGetDeviceInfo(*devid, CL_DEVICE_VERSION, sizeof(devver), devver, NULL);
-	log_info("OpenCL Device %s  %s", devname, devver);
-
-	cl_int ret;
-	cl_context clctx = clCreateContext(NULL, 1, devid, NULL, NULL, &ret);
-	OCLCHECK(ret);
-	cl_command_queue clque = clCreateCommandQueue(clctx, *devid, 0, &ret);
-	OCLCHECK(ret);
-
-	// Build the kernel
-	char *kpath = NULL;
-	char *clsrc = load_kernel(args.kernel, &kpath);
-
-	if (!clsrc) {
-		return EXIT_FAILURE;
+	ret = clBuildProgram(clprg, 1, &rc->devid, compargs, NULL, NULL);
+	if (ret != CL_SUCCESS) {
+		log_warn("Ignoring unusable cached program %s", path);
+		clReleaseProgram(clprg);
+		return NULL;
 	}
 
-	log_info("Loaded kernel from %s", kpath);
-
-	char *kdir = dirname(kpath);
-	char compargs[1000];
-	bzero(compargs, sizeof(compargs));
-	snprintf(compargs, ARRAY_SIZE(compargs),
-			"-I%s -DCOLORS_LEN=%d -DTILE_SIZE=%d %s",
-			kdir, COLORMAP_LEN, TILE_SIZE, args.clargs);
+	log_info("Loaded cached program %s", path);
+	return clprg;
+}
 
-	cl_program clprg = clCreateProgramWithSource(clctx, 1, (const char **)&clsrc, NULL, &ret);
-	OCLCHECK(ret);
-	ret = clBuildProgram(clprg, 1, devid, compargs, NULL, NULL);
+static void save_cached_program(struct render_ctx *rc, const char *compargs,
+								cl_program clprg)
+{
+	size_t len;
+	cl_int ret = clGetProgramInfo(clprg, CL_PROGRAM_BINARY_SIZES, sizeof(len), &len, NULL);
+	if (ret != CL_SUCCESS || len == 0) {
+		return;
+	}
+	unsigned char *data = malloc(len);
+	if (data == NULL) {
+		return;
+	}
+	ret = clGetProgramInfo(clprg, CL_PROGRAM_BINARIES, sizeof(data), &data, NULL);
 	if (ret != CL_SUCCESS) {
-		log_error_clerr("Kernel build failed, dumping compiler output", ret);
-		size_t len;
-		clGetProgramBuildInfo(clprg, *devid, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
-		char msg[len];
-		clGetProgramBuildInfo(clprg, *devid, CL_PROGRAM_BUILD_LOG, len, msg, NULL);
-		fprintf(stderr, "%s\n", msg);
-		return EXIT_FAILURE;
+		free(data);
+		return;
 	}
-	cl_kernel clkrn = clCreateKernel(clprg, "generate_pixel", &ret);
-	OCLCHECK(ret);
+
+	char dirpath[PATH_MAX];
+	snprintf(dirpath, sizeof(dirpath), "%s/programs", rc->args->outdir);
+	char path[PATH_MAX];
+	program_cache_path(rc, compargs, path, sizeof(path));
+	char tmppath[PATH_MAX];
+	// Identical devices share the cache file
+	snprintf(tmppath, sizeof(tmppath), "%s.%u.tmp", path, rc->index);
+
+	FILE *file = NULL;
+	if (mkdir_recursive(dirpath, S_IRWXU) == 0) {
+		file = fopen(tmppath, "wb");
+	}
+	if (file == NULL) {
+		log_error_errno("Failed to save the program cache file %s", path);
+		free(data);
+		return;
+	}
+	bool ok = fwrite(data, 1, len, file) == len;
+	if (fclose(file) == 0 && ok && rename(tmppath, path) == 0) {
+		log_info("Saved program cache file %s", path);
+	} else {
+		log_error_errno("Failed to save the program cache file %s", path);
+		unlink(tmppath);
+	}
+	free(data);
+}
+
+static cl_program build_program(struct render_ctx *rc, const char *compargs)
+{
+	cl_program clprg = load_cached_program(rc, compargs);
+	if (clprg != NULL) {
+		return clprg;
+	}
+
+	cl_int ret;
+	clprg = clCreateProgramWithSource(rc->clctx, 1, &rc->clsrc, NULL, &ret);
+	OCLCHECK(ret);
+	ret = clBuildProgram(clprg, 1, &rc->devid, compargs, NULL, NULL);
+	if (ret != CL_SUCCESS) {
+		log_build_failure(clprg, rc->devid, ret);
+		clReleaseProgram(clprg);
+		return NULL;
+	}
+	save_cached_program(rc, compargs, clprg);
+	return clprg;
+}
+
+// Makes room for n more ranges in the host buffers of the slot
+static void slot_reserve_ranges(struct tile_slot *slot, size_t n)
+{
+	size_t need = slot->nranges + n;
+	if (need <= slot->rangescap) {
+		return;
+	}
+	size_t cap = max(2 * slot->rangescap, need);
+	cl_uint2 *ranges = realloc(slot->ranges, cap * sizeof(ranges[0]));
+	if (ranges != NULL) {
+		slot->ranges = ranges;
+	}
+	cl_uint *ends = realloc(slot->ends, cap * sizeof(ends[0]));
+	if (ends != NULL) {
+		slot->ends = ends;
+	}
+	if (ranges == NULL || ends == NULL) {
+		log_error("Failed to allocate %zu point ranges", cap);
+		exit(EXIT_FAILURE);
+	}
+	slot->rangescap = cap;
+}
+
+// Finds the point ranges the tile needs and puts them after the ranges of
+// the slot, returns their count
+static cl_uint tile_ranges(struct render_ctx *rc, const struct tile_job *job,
+						   struct tile_slot *slot, cl_uint *npts)
+{
+	cl_uint nranges;
+	cl_uint2 *ranges;
+	if (rc->grid != NULL) {
+		double tstart = time_monotonic();
+		slot_reserve_ranges(slot, grid_query_max(rc->grid, job->bounds));
+		ranges = slot->ranges + slot->nranges;
+		nranges = grid_query(rc->grid, job->bounds, ranges);
+		rc->tquery += time_monotonic() - tstart;
+	} else {
+		slot_reserve_ranges(slot, 1);
+		ranges = slot->ranges + slot->nranges;
+		ranges[0] = (cl_uint2){ .x = 0, .y = rc->datalen };
+		nranges = rc->datalen > 0;
+	}
+	*npts = 0;
+	for (size_t i = 0; i < nranges; i++) {
+		*npts += ranges[i].y - ranges[i].x;
+	}
+	return nranges;
+}
+
+// Starts the uploads of the tiles of the slot and points the kernels at
+// them, returns the event of the uploads
+static cl_event bind_slot(struct render_ctx *rc, struct tile_slot *slot)
+{
+	cl_kernel krns[] = { rc->clkrn, rc->splatkrn };
+	cl_event written[5];
+	cl_uint nwritten = 0;
+	cl_int ret;
+
+	if (slot->nranges > slot->clrangescap) {
+		// The old buffers go away once the commands still using them are done
+		clReleaseMemObject(slot->ranges_cl);
+		slot->ranges_cl = clCreateBuffer(rc->clctx, CL_MEM_READ_ONLY,
+										 slot->rangescap * sizeof(cl_uint2), NULL, &ret);
+		OCLCHECK(ret);
+		if (slot->ends_cl != NULL) {
+			clReleaseMemObject(slot->ends_cl);
+			slot->ends_cl = clCreateBuffer(rc->clctx, CL_MEM_READ_ONLY,
+										   slot->rangescap * sizeof(cl_uint), NULL, &ret);
+			OCLCHECK(ret);
+		}
+		slot->clrangescap = slot->rangescap;
+	}
+
+	ret = clEnqueueWriteBuffer(rc->clque, slot->ranges_cl, CL_FALSE, 0,
+							   slot->nranges * sizeof(slot->ranges[0]), slot->ranges,
+							   0, NULL, &written[nwritten++]);
+	OCLCHECK(ret);
+	if (rc->batch > 1) {
+		ret = clEnqueueWriteBuffer(rc->clque, slot->trx_cl, CL_FALSE, 0,
+								   slot->njobs * sizeof(slot->trx[0]), slot->trx,
+								   0, NULL, &written[nwritten++]);
+		OCLCHECK(ret);
+		ret = clEnqueueWriteBuffer(rc->clque, slot->try_cl, CL_FALSE, 0,
+								   slot->njobs * sizeof(slot->try[0]), slot->try,
+								   0, NULL, &written[nwritten++]);
+		OCLCHECK(ret);
+		ret = clEnqueueWriteBuffer(rc->clque, slot->batch_cl, CL_FALSE, 0,
+								   slot->njobs * sizeof(slot->batch[0]), slot->batch,
+								   0, NULL, &written[nwritten++]);
+		OCLCHECK(ret);
+	}
+	if (rc->splatkrn != NULL) {
+		ret = clEnqueueWriteBuffer(rc->clque, slot->ends_cl, CL_FALSE, 0,
+								   slot->nranges * sizeof(slot->ends[0]), slot->ends,
+								   0, NULL, &written[nwritten++]);
+		OCLCHECK(ret);
+	}
+
+	// The kernels take the same first arguments, see TILE_ARGS in common.h
+	for (size_t k = 0; k < ARRAY_SIZE(krns) && krns[k] != NULL; k++) {
+		if (rc->batch > 1) {
+			ret = clSetKernelArg(krns[k], 0, sizeof(slot->trx_cl), &slot->trx_cl);
+			OCLCHECK(ret);
+			ret = clSetKernelArg(krns[k], 1, sizeof(slot->try_cl), &slot->try_cl);
+			OCLCHECK(ret);
+			ret = clSetKernelArg(krns[k], 2, sizeof(slot->batch_cl), &slot->batch_cl);
+			OCLCHECK(ret);
+		} else {
+			cl_uint nranges = slot->batch[0].y;
+			ret = clSetKernelArg(krns[k], 0, sizeof(slot->trx[0]), &slot->trx[0]);
+			OCLCHECK(ret);
+			ret = clSetKernelArg(krns[k], 1, sizeof(slot->try[0]), &slot->try[0]);
+			OCLCHECK(ret);
+			ret = clSetKernelArg(krns[k], 2, sizeof(nranges), &nranges);
+			OCLCHECK(ret);
+		}
+		ret = clSetKernelArg(krns[k], 3, sizeof(slot->ranges_cl), &slot->ranges_cl);
+		OCLCHECK(ret);
+	}
+	ret = clSetKernelArg(rc->clkrn, 8, sizeof(slot->tile_cl), &slot->tile_cl);
+	OCLCHECK(ret);
+	if (rc->splatkrn != NULL) {
+		ret = clSetKernelArg(rc->splatkrn, 8, sizeof(slot->accum_cl), &slot->accum_cl);
+		OCLCHECK(ret);
+		ret = clSetKernelArg(rc->clkrn, 9, sizeof(slot->accum_cl), &slot->accum_cl);
+		OCLCHECK(ret);
+		ret = clSetKernelArg(rc->splatkrn, 9, sizeof(slot->ends_cl), &slot->ends_cl);
+		OCLCHECK(ret);
+	}
+
+	if (nwritten == 1) {
+		return written[0];
+	}
+	cl_event ready;
+	ret = clEnqueueMarkerWithWaitList(rc->clque, nwritten, written, &ready);
+	OCLCHECK(ret);
+	for (size_t i = 0; i < nwritten; i++) {
+		clReleaseEvent(written[i]);
+	}
+	return ready;
+}
+
+// Adds the tile to the slot, its nranges ranges already follow the ranges of
+// the tiles added before
+static void slot_add_tile(struct tile_slot *slot, struct tile_job *job,
+						  cl_uint nranges)
+{
+	cl_uint end = 0;
+	for (cl_uint r = slot->nranges; r < slot->nranges + nranges; r++) {
+		end += slot->ranges[r].y - slot->ranges[r].x;
+		slot->ends[r] = end;
+	}
+	slot->jobs[slot->njobs] = job;
+	slot->trx[slot->njobs] = job->tr[0];
+	slot->try[slot->njobs] = job->tr[1];
+	slot->batch[slot->njobs] = (cl_uint2){ .x = slot->nranges, .y = nranges };
+	slot->njobs++;
+	slot->nranges += nranges;
+	slot->maxpts = max(slot->maxpts, end);
+}
+
+// The splat pass accumulates the point footprints of the tiles of the slot,
+// generate_pixel then takes the sums instead of the points. Waits for and
+// releases ready, returns the event of the pass.
+static cl_event enqueue_splat(struct render_ctx *rc, struct tile_slot *slot, cl_event ready)
+{
+	size_t tilelen = (size_t)rc->tilesize * rc->tilesize;
+	cl_event deps[2] = { ready, NULL };
+	const cl_float zero = 0.0f;
+	cl_int ret = clEnqueueFillBuffer(rc->clque, slot->accum_cl, &zero, sizeof(zero), 0,
+									 slot->njobs * tilelen * sizeof(cl_float),
+									 0, NULL, &deps[1]);
+	OCLCHECK(ret);
+
+	// A work-item per point
+	cl_event done;
+	size_t splat_size[] = { slot->maxpts, 1, slot->njobs };
+	ret = clEnqueueNDRangeKernel(rc->clque, rc->splatkrn, rc->batch > 1 ? 3 : 2, NULL,
+								 splat_size, NULL, ARRAY_SIZE(deps), deps, &done);
+	OCLCHECK(ret);
+	clReleaseEvent(deps[0]);
+	clReleaseEvent(deps[1]);
+	return done;
+}
+
+struct work_group_limits {
+	size_t maxsize;
+	size_t maxitems[3];
+};
+
+static void work_group_limits(struct render_ctx *rc, struct work_group_limits *lim)
+{
+	lim->maxsize = 1;
+	clGetKernelWorkGroupInfo(rc->clkrn, rc->devid, CL_KERNEL_WORK_GROUP_SIZE,
+							 sizeof(lim->maxsize), &lim->maxsize, NULL);
+	lim->maxitems[0] = lim->maxitems[1] = lim->maxitems[2] = 1;
+	clGetDeviceInfo(rc->devid, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+					sizeof(lim->maxitems), lim->maxitems, NULL);
+}
+
+static bool work_group_fits(const struct work_group_limits *lim, const size_t *local)
+{
+	return local[0] > 0 && local[1] > 0 &&
+		local[0] * local[1] <= lim->maxsize &&
+		local[0] <= lim->maxitems[0] && local[1] <= lim->maxitems[1] &&
+		TILE_SIZE % local[0] == 0 && TILE_SIZE % local[1] == 0;
+}
+
+// The work-items of a group share the points they load (see heat.cl), so
+// without a tuned profile the group is as large as the kernel allows on the
+// device. The shape is kept square-ish and dividing the tile size.
+static void default_work_group_size(const struct work_group_limits *lim, size_t *local)
+{
+	local[0] = local[1] = 1;
+	for (bool grown = true; grown; ) {
+		grown = false;
+		for (size_t d = 0; d < 2; d++) {
+			size_t next[2] = { local[0], local[1] };
+			next[d] *= 2;
+			if (work_group_fits(lim, next)) {
+				local[d] *= 2;
+				grown = true;
+			}
+		}
+	}
+}
+
+// The profile depends on the kernel sources and the device, but not on the
+// compiler arguments, which differ between the zoomlevels
+static void tuning_profile_path(struct render_ctx *rc, char *path, size_t len)
+{
+	snprintf(path, len, "%s/tuning/%016" PRIx64 ".txt", rc->args->outdir, rc->prghash);
+}
+
+static int load_tuning_profile(struct render_ctx *rc, const struct work_group_limits *lim)
+{
+	char path[PATH_MAX];
+	tuning_profile_path(rc, path, sizeof(path));
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return -1;
+	}
+	size_t local[2];
+	int ret = fscanf(file, "%zu %zu", &local[0], &local[1]) == 2 &&
+		work_group_fits(lim, local) ? 0 : -1;
+	fclose(file);
+	if (ret) {
+		log_error("Ignoring the invalid tuning profile %s", path);
+		return -1;
+	}
+	rc->local_work_size[0] = local[0];
+	rc->local_work_size[1] = local[1];
+	return 0;
+}
+
+static void save_tuning_profile(struct render_ctx *rc)
+{
+	char dirpath[PATH_MAX];
+	snprintf(dirpath, sizeof(dirpath), "%s/tuning", rc->args->outdir);
+	char path[PATH_MAX];
+	tuning_profile_path(rc, path, sizeof(path));
+	char tmppath[PATH_MAX];
+	snprintf(tmppath, sizeof(tmppath), "%s.%u.tmp", path, rc->index);
+
+	FILE *file = NULL;
+	if (mkdir_recursive(dirpath, S_IRWXU) == 0) {
+		file = fopen(tmppath, "w");
+	}
+	if (file == NULL) {
+		log_error_errno("Failed to save the tuning profile %s", path);
+		return;
+	}
+	fprintf(file, "%zu %zu\n", rc->local_work_size[0], rc->local_work_size[1]);
+	if (fclose(file) == 0 && rename(tmppath, path) == 0) {
+		log_info("Saved tuning profile %s", path);
+	} else {
+		log_error_errno("Failed to save the tuning profile %s", path);
+		unlink(tmppath);
+	}
+}
+
+// Times every power of two work-group shape on a sample of the tiles of the
+// zoomlevel and keeps the fastest one
+static int tune_work_group_size(struct render_ctx *rc, const struct work_group_limits *lim)
+{
+	struct tile_queue *queue = rc->queue;
+	struct tile_slot *slot = &rc->slots[0];
+	cl_int ret;
+
+	// Groups using a small fraction of the device are never competitive
+	size_t cands[64][2];
+	size_t ncands = 0;
+	for (size_t lx = 1; lx <= TILE_SIZE; lx *= 2) {
+		for (size_t ly = 1; ly <= TILE_SIZE; ly *= 2) {
+			size_t local[2] = { lx, ly };
+			if (work_group_fits(lim, local) && lx * ly * 8 >= lim->maxsize &&
+					ncands < ARRAY_SIZE(cands)) {
+				cands[ncands][0] = lx;
+				cands[ncands][1] = ly;
+				ncands++;
+			}
+		}
+	}
+	double times[ARRAY_SIZE(cands)] = { 0.0 };
+
+	// Spread across the zoomlevel first, then the tiles in between, until
+	// enough of them have any points
+	size_t nsamples = 0;
+	size_t stride = max(queue->len / SAMPLE_TILES, (size_t)1);
+	for (size_t first = 0; first < stride && nsamples < SAMPLE_TILES; first++) {
+		for (size_t i = first; i < queue->len && nsamples < SAMPLE_TILES; i += stride) {
+			struct tile_job *job = &queue->jobs[i];
+			cl_uint npts;
+			// A batch of the single tile
+			slot->njobs = 0;
+			slot->nranges = 0;
+			slot->maxpts = 0;
+			cl_uint nranges = tile_ranges(rc, job, slot, &npts);
+			if (npts == 0) {
+				continue;
+			}
+			nsamples++;
+
+			slot_add_tile(slot, job, nranges);
+			cl_event written = bind_slot(rc, slot);
+			if (rc->splatkrn != NULL) {
+				// Only generate_pixel is tuned, it needs the sums though
+				written = enqueue_splat(rc, slot, written);
+			}
+			ret = clWaitForEvents(1, &written);
+			OCLCHECK(ret);
+			clReleaseEvent(written);
+
+			size_t global_work_size[] = { rc->tilesize, rc->tilesize, 1 };
+			// The first launch pays for the warm up
+			for (size_t c = 0; c <= ncands; c++) {
+				size_t *cand = cands[c > 0 ? c - 1 : 0];
+				size_t local[3] = { cand[0], cand[1], 1 };
+				double tstart = time_monotonic();
+				ret = clEnqueueNDRangeKernel(rc->clque, rc->clkrn, rc->batch > 1 ? 3 : 2, NULL,
+											 global_work_size, local, 0, NULL, NULL);
+				OCLCHECK(ret);
+				clFinish(rc->clque);
+				if (c > 0) {
+					times[c - 1] += time_monotonic() - tstart;
+				}
+			}
+		}
+	}
+	if (nsamples == 0 || ncands == 0) {
+		log_error("No tiles to tune the work-group size on %s", rc->devname);
+		return -1;
+	}
+
+	size_t best = 0;
+	for (size_t c = 0; c < ncands; c++) {
+		log_info("Work-group %zux%zu took %.3fms per tile on %s", cands[c][0], cands[c][1],
+				 times[c] / nsamples * 1000.0, rc->devname);
+		if (times[c] < times[best]) {
+			best = c;
+		}
+	}
+	rc->local_work_size[0] = cands[best][0];
+	rc->local_work_size[1] = cands[best][1];
+	return 0;
+}
+
+static void choose_work_group_size(struct render_ctx *rc)
+{
+	struct work_group_limits lim;
+	work_group_limits(rc, &lim);
+
+	// A zoomlevel without any points to tune on leaves it to the next one
+	bool tuned = false;
+	if (rc->args->tune && !rc->tuned) {
+		log_info("Tuning the work-group size on %s", rc->devname);
+		tuned = rc->tuned = tune_work_group_size(rc, &lim) == 0;
+		if (tuned) {
+			save_tuning_profile(rc);
+		}
+	}
+	if (!tuned && load_tuning_profile(rc, &lim)) {
+		default_work_group_size(&lim, rc->local_work_size);
+	}
+	// Every tile of a batch is a work-group layer of its own
+	rc->local_work_size[2] = 1;
+	log_info("Using %zux%zu work-groups on %s", rc->local_work_size[0],
+			 rc->local_work_size[1], rc->devname);
+}
+
+// Only the kernels with a splat_points pass need the sums, which take four
+// times the memory of the tiles, so they are allocated once such a kernel
+// gets built
+static int alloc_splat_buffers(struct render_ctx *rc)
+{
+	if (rc->splatkrn == NULL || rc->slots[0].accum_cl != NULL) {
+		return 0;
+	}
+	size_t side = TILE_SIZE * rc->args->metatile;
+	size_t size = rc->batch * side * side * sizeof(cl_float);
+	cl_ulong maxalloc = 0;
+	clGetDeviceInfo(rc->devid, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxalloc), &maxalloc, NULL);
+	if (size > maxalloc) {
+		log_error("Device %s can allocate up to %" PRIu64 "MB at once, the sums of --metatile %u "
+				  "--batch %zu take %zuMB", rc->devname, (uint64_t)(maxalloc >> 20),
+				  rc->args->metatile, rc->batch, size >> 20);
+		return -1;
+	}
+
+	cl_int ret;
+	for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+		struct tile_slot *slot = &rc->slots[i];
+		slot->accum_cl = clCreateBuffer(rc->clctx, CL_MEM_READ_WRITE, size, NULL, &ret);
+		OCLCHECK(ret);
+		slot->ends_cl = clCreateBuffer(rc->clctx, CL_MEM_READ_ONLY,
+									   slot->clrangescap * sizeof(cl_uint), NULL, &ret);
+		OCLCHECK(ret);
+	}
+	return 0;
+}
+
+// RANGE of the zoomlevel from the zoom table, or from -DRANGE=... in the
+// compiler arguments, NAN if neither has it
+static float zoom_range(struct arguments *args, int zoom)
+{
+	float range = args->zooms[zoom].range;
+	if (isnan(range) && cpu_find_define(args->clargs, "RANGE", &range)) {
+		range = NAN;
+	}
+	return range;
+}
+
+// Passes RANGE of the zoomlevel to the kernels, which are then built just
+// once for all the zoomlevels
+static int set_kernel_range(struct render_ctx *rc, int zoom)
+{
+	cl_float range = zoom_range(rc->args, zoom);
+	if (isnan(range)) {
+		// Kernels such as tdoa do without
+		if (strstr(rc->clsrc, "RANGE") != NULL) {
+			log_error("No RANGE for zoomlevel %d, set it with --zoom-table or -DRANGE=...",
+					  zoom);
+			return -1;
+		}
+		range = 0.0f;
+	}
+	cl_kernel krns[] = { rc->clkrn, rc->splatkrn };
+	for (size_t k = 0; k < ARRAY_SIZE(krns) && krns[k] != NULL; k++) {
+		cl_int ret = clSetKernelArg(krns[k], 4, sizeof(range), &range);
+		OCLCHECK(ret);
+	}
+	return 0;
+}
+
+// Makes sure the kernel is built with the arguments the zoomlevel needs
+static int prepare_kernel(struct render_ctx *rc, int zoom)
+{
+	struct arguments *args = rc->args;
+	// The kernels see the whole metatile as a single tile
+	int tilesize = TILE_SIZE * zoom_metatile(args, zoom);
+	char compargs[sizeof(rc->compargs)];
+	int len = snprintf(compargs, sizeof(compargs),
+					   "-I%s -DCOLORS_LEN=%d -DTILE_SIZE=%d -DSUBTILE_SIZE=%d%s%s %s",
+					   rc->kdir, COLORMAP_LEN, tilesize, TILE_SIZE,
+					   rc->batch > 1 ? " -DBATCH" : "",
+					   args->great_circle ? " -DGREAT_CIRCLE" : "", args->clargs);
+	// The OpenCL kernels take RANGE as an argument, see set_kernel_range
+	if (rc->backend != BACKEND_OPENCL && !isnan(args->zooms[zoom].range)) {
+		snprintf(compargs + len, sizeof(compargs) - len, " -DRANGE=%g",
+				 args->zooms[zoom].range);
+	}
+	if (rc->backend == BACKEND_OPENCL && args->kproj.type != KERNEL_PROJECTION_NONE &&
+			kernel_projection_args(&args->kproj, compargs, sizeof(compargs))) {
+		log_error("The projection does not fit into the compiler arguments");
+		return -1;
+	}
+
+	if (rc->compargs[0] != '\0' && !strcmp(compargs, rc->compargs)) {
+		return rc->backend == BACKEND_OPENCL ? set_kernel_range(rc, zoom) : 0;
+	}
+	rc->tilesize = tilesize;
+	if (rc->backend != BACKEND_OPENCL) {
+		if (rc->index == 0) {
+			log_info("Setting up the %s %s kernel with '%s'", cpu_kernel_isa(),
+					 rc->backend == BACKEND_CPU ? "CPU" : "approximate", compargs);
+		}
+		if (rc->backend == BACKEND_CPU ?
+				cpu_kernel_init(&rc->cpukrn, args->kernel, compargs, tilesize) :
+				approx_kernel_init(&rc->approxkrn, args->kernel, compargs, tilesize)) {
+			return -1;
+		}
+		rc->cpukrn.refpt = rc->refpt;
+		strlcpy(rc->compargs, compargs, sizeof(rc->compargs));
+		return 0;
+	}
+	if (rc->clprg != NULL) {
+		if (rc->splatkrn != NULL) {
+			clReleaseKernel(rc->splatkrn);
+		}
+		clReleaseKernel(rc->clkrn);
+		clReleaseProgram(rc->clprg);
+	}
+
+	log_info("Building the kernel with '%s'", compargs);
+	rc->clprg = build_program(rc, compargs);
+	if (rc->clprg == NULL) {
+		return -1;
+	}
+	strlcpy(rc->compargs, compargs, sizeof(rc->compargs));
+
+	cl_int ret;
+	rc->clkrn = clCreateKernel(rc->clprg, "generate_pixel", &ret);
+	OCLCHECK(ret);
+	ret = clSetKernelArg(rc->clkrn, 5, sizeof(rc->refpt), &rc->refpt);
+	OCLCHECK(ret);
+	ret = clSetKernelArg(rc->clkrn, 6, sizeof(rc->pts_cl), &rc->pts_cl);
+	OCLCHECK(ret);
+	ret = clSetKernelArg(rc->clkrn, 7, sizeof(rc->vals_cl), &rc->vals_cl);
+	OCLCHECK(ret);
+	rc->splatkrn = clCreateKernel(rc->clprg, "splat_points", &ret);
+	if (ret == CL_SUCCESS) {
+		ret = clSetKernelArg(rc->splatkrn, 5, sizeof(rc->refpt), &rc->refpt);
+		OCLCHECK(ret);
+		ret = clSetKernelArg(rc->splatkrn, 6, sizeof(rc->pts_cl), &rc->pts_cl);
+		OCLCHECK(ret);
+		ret = clSetKernelArg(rc->splatkrn, 7, sizeof(rc->vals_cl), &rc->vals_cl);
+		OCLCHECK(ret);
+	} else {
+		rc->splatkrn = NULL;
+	}
+	if (alloc_splat_buffers(rc) || set_kernel_range(rc, zoom)) {
+		return -1;
+	}
+	choose_work_group_size(rc);
+
+	return 0;
+}
+
+static void tile_path(struct render_ctx *rc, unsigned int tx, unsigned int ty,
+					  char *path, size_t len)
+{
+	snprintf(path, len, "%s/%d/%d/%d.png", rc->args->outdir, rc->queue->zoom, tx, ty);
+}
+
+// Like tile_path, but also makes sure the directory of the tile column exists
+static int prepare_tile_path(struct render_ctx *rc, unsigned int tx, unsigned int ty,
+							 char *path, size_t len)
+{
+	char dirpath[PATH_MAX];
+	snprintf(dirpath, sizeof(dirpath), "%s/%d/%d", rc->args->outdir, rc->queue->zoom, tx);
+	// Usually there already, the whole path only has to be created once
+	if (mkdir(dirpath, 0755) == 0 || errno == EEXIST) {
+		tile_path(rc, tx, ty, path, len);
+		return 0;
+	}
+	char mkpath[PATH_MAX];
+	strlcpy(mkpath, dirpath, sizeof(mkpath));
+	if (mkdir_recursive(mkpath, 0755)) {
+		log_error_errno("Failed to create the tile directory %s", dirpath);
+		return -1;
+	}
+	tile_path(rc, tx, ty, path, len);
+	return 0;
+}
+
+static bool tile_requested(const struct tile_queue *queue, unsigned int tx, unsigned int ty)
+{
+	return tx >= queue->left && tx < queue->right && ty >= queue->top && ty < queue->bot;
+}
+
+// Slices the rendered metatile into the tiles and passes them on to the
+// writer, takes over the image
+static void submit_tiles(struct render_ctx *rc, struct tile_job *job, uint8_t *img)
+{
+	struct tile_queue *queue = rc->queue;
+	char path[PATH_MAX];
+	if (queue->metatile == 1) {
+		if (prepare_tile_path(rc, job->tx, job->ty, path, sizeof(path))) {
+			__atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+			free(img);
+			return;
+		}
+		writer_submit(rc->writer, path, img, &job->failed);
+		return;
+	}
+
+	for (unsigned int i = 0; i < queue->metatile; i++) {
+		for (unsigned int j = 0; j < queue->metatile; j++) {
+			if (!tile_requested(queue, job->tx + i, job->ty + j)) {
+				continue;
+			}
+			if (prepare_tile_path(rc, job->tx + i, job->ty + j, path, sizeof(path))) {
+				__atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			uint8_t *tile = malloc(TILE_SIZE * TILE_SIZE * sizeof(uint8_t));
+			for (size_t y = 0; y < TILE_SIZE; y++) {
+				memcpy(tile + y * TILE_SIZE,
+					   img + (j * TILE_SIZE + y) * rc->tilesize + i * TILE_SIZE,
+					   TILE_SIZE * sizeof(uint8_t));
+			}
+			writer_submit(rc->writer, path, tile, &job->failed);
+		}
+	}
+	free(img);
+}
+
+static void link_blank_tiles(struct render_ctx *rc, struct tile_job *job)
+{
+	struct tile_queue *queue = rc->queue;
+	for (unsigned int i = 0; i < queue->metatile; i++) {
+		for (unsigned int j = 0; j < queue->metatile; j++) {
+			char path[PATH_MAX];
+			if (!tile_requested(queue, job->tx + i, job->ty + j)) {
+				continue;
+			}
+			if (prepare_tile_path(rc, job->tx + i, job->ty + j, path, sizeof(path))) {
+				__atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			// The tile might have been rendered by an earlier run
+			unlink(path);
+			if (link(rc->blankfilepath, path)) {
+				log_error_errno("Failed to link %s to %s", path, rc->blankfilepath);
+				__atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			log_info(" linked %s to %s", path, rc->blankfilepath);
+		}
+	}
+}
+
+// Hashes everything the tile depends on besides the configuration, the
+// points within the prefilter and the transform. The grid cells reach past
+// the prefilter and their order follows the whole input, so only the points
+// inside the bounds count, summed up so that their order does not matter.
+// Adding points elsewhere then leaves the hash alone.
+static uint64_t job_hash(struct render_ctx *rc, const struct tile_job *job,
+						 const cl_uint2 *ranges, cl_uint nranges)
+{
+	uint64_t hash = hash_bytes(rc->queue->confighash, job->tr, sizeof(job->tr));
+	uint64_t sum = 0;
+	size_t n = 0;
+	for (cl_uint r = 0; r < nranges; r++) {
+		for (cl_uint i = ranges[r].x; i < ranges[r].y; i++) {
+			if (!rect_is_inside(job->bounds, rc->pts[i])) {
+				continue;
+			}
+			uint64_t pt = hash_bytes(HASH_INIT, &rc->pts[i], sizeof(rc->pts[i]));
+			pt = hash_bytes(pt, &rc->vals[i], sizeof(rc->vals[i]));
+			// FNV-1a alone leaves similar points with similar hashes, which
+			// the sum could cancel out
+			pt ^= pt >> 33;
+			pt *= 0xff51afd7ed558ccdull;
+			pt ^= pt >> 33;
+			sum += pt;
+			n++;
+		}
+	}
+	hash = hash_bytes(hash, &sum, sizeof(sum));
+	hash = hash_bytes(hash, &n, sizeof(n));
+	return hash != 0 ? hash : 1;
+}
+
+// Whether the tiles of the job are on the disk already, rendered from the
+// same inputs
+static bool job_unchanged(struct render_ctx *rc, const struct tile_job *job)
+{
+	struct tile_queue *queue = rc->queue;
+	if (rc->args->force || manifest_lookup(queue->manifest, job->tx, job->ty) != job->hash) {
+		return false;
+	}
+	for (unsigned int i = 0; i < queue->metatile; i++) {
+		for (unsigned int j = 0; j < queue->metatile; j++) {
+			char path[PATH_MAX];
+			tile_path(rc, job->tx + i, job->ty + j, path, sizeof(path));
+			if (tile_requested(queue, job->tx + i, job->ty + j) && access(path, F_OK)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Waits for the batch in the slot (if any) and passes it on to the writer
+static void slot_retire(struct render_ctx *rc, struct tile_slot *slot)
+{
+	if (slot->tile == NULL) {
+		return;
+	}
+	cl_int ret = clWaitForEvents(1, &slot->done);
+	OCLCHECK(ret);
+	clReleaseEvent(slot->done);
+	if (slot->njobs == 1) {
+		submit_tiles(rc, slot->jobs[0], slot->tile);
+	} else {
+		size_t tilelen = (size_t)rc->tilesize * rc->tilesize;
+		for (size_t k = 0; k < slot->njobs; k++) {
+			uint8_t *img = malloc(tilelen * sizeof(uint8_t));
+			memcpy(img, slot->tile + k * tilelen, tilelen * sizeof(uint8_t));
+			submit_tiles(rc, slot->jobs[k], img);
+		}
+		free(slot->tile);
+	}
+	slot->tile = NULL;
+}
+
+// Bounds of the metatile in (latitude, longitude) radians for the great
+// circle distances. A meter is the same angle in latitude everywhere, in
+// longitude it grows towards the poles, so the worse latitude of the tile
+// decides. Tiles reaching a pole take all the longitudes.
+static struct rect tile_bounds_wgs84(unsigned int mx, unsigned int my, int metazoom,
+									 float prefilter)
+{
+	cl_float2 lt = tile_to_wgs84((cl_float2){ .x = mx, .y = my }, metazoom);
+	cl_float2 rb = tile_to_wgs84((cl_float2){ .x = mx + 1, .y = my + 1 }, metazoom);
+	struct rect bounds = rect_make(
+		(cl_float2){ .x = lt.x * M_PI / 180.0, .y = lt.y * M_PI / 180.0 },
+		(cl_float2){ .x = rb.x * M_PI / 180.0, .y = rb.y * M_PI / 180.0 });
+	double dlat = prefilter / EARTH_RADIUS;
+	double maxlat = max(fabs(rect_left(bounds)), fabs(rect_right(bounds))) + dlat;
+	double dlng = maxlat < M_PI / 2 ? dlat / cos(maxlat) : INFINITY;
+	bounds.lt.x -= dlat;
+	bounds.rb.x += dlat;
+	bounds.lt.y -= dlng;
+	bounds.rb.y += dlng;
+	return bounds;
+}
+
+// Renders the tiles, on the OpenCL device all of them in a single launch
+static void render_batch(struct render_ctx *rc, struct tile_job *jobs, size_t njobs)
+{
+	cl_int ret;
+
+	// The oldest batch in flight has to be out of the way before its slot
+	// gets reused
+	struct tile_slot *slot = &rc->slots[rc->nextslot];
+	slot_retire(rc, slot);
+
+	size_t tilelen = (size_t)rc->tilesize * rc->tilesize;
+	slot->njobs = 0;
+	slot->nranges = 0;
+	slot->maxpts = 0;
+	for (size_t i = 0; i < njobs; i++) {
+		struct tile_job *job = &jobs[i];
+		if (rc->queue->metatile > 1) {
+			log_info("Processing (%d,%d) to (%d,%d)", job->tx, job->ty,
+					 job->tx + rc->queue->metatile - 1, job->ty + rc->queue->metatile - 1);
+		} else {
+			log_info("Processing (%d,%d)", job->tx, job->ty);
+		}
+
+		cl_uint npts;
+		cl_uint nranges = tile_ranges(rc, job, slot, &npts);
+		const cl_uint2 *ranges = slot->ranges + slot->nranges;
+
+		if (npts == 0) {
+			log_info(" skipping...");
+			job->hash = 0;
+			if (manifest_lookup(rc->queue->manifest, job->tx, job->ty) != 0) {
+				rc->stats.removed++;
+			}
+			link_blank_tiles(rc, job);
+			continue;
+		}
+		// Nothing to do if the points did not change since the last run
+		job->hash = job_hash(rc, job, ranges, nranges);
+		if (job_unchanged(rc, job)) {
+			log_info(" unchanged, skipping...");
+			rc->stats.skipped++;
+			continue;
+		}
+		rc->stats.rendered++;
+
+		log_info(" generating from %d...", npts);
+		if (rc->backend != BACKEND_OPENCL) {
+			uint8_t *tile = malloc(tilelen * sizeof(uint8_t));
+			if (rc->backend == BACKEND_CPU) {
+				cpu_render_tile(&rc->cpukrn, job->tr, nranges, ranges,
+								rc->pts, rc->vals, tile);
+			} else {
+				approx_render_tile(&rc->approxkrn, job->tr, nranges, ranges,
+								   rc->pts, rc->vals, tile);
+			}
+			submit_tiles(rc, job, tile);
+			continue;
+		}
+
+		slot_add_tile(slot, job, nranges);
+	}
+	if (slot->njobs == 0) {
+		return;
+	}
+
+	// Nothing here blocks, the commands are chained by events so that the
+	// device can work on this batch while the host prepares the next one.
+	// The host ranges stay untouched until the slot is retired.
+	cl_event ready = bind_slot(rc, slot);
+	cl_event rendered;
+	cl_uint dims = rc->batch > 1 ? 3 : 2;
+
+	if (rc->splatkrn != NULL) {
+		ready = enqueue_splat(rc, slot, ready);
+	}
+
+	size_t global_work_size[] = { rc->tilesize, rc->tilesize, slot->njobs };
+	ret = clEnqueueNDRangeKernel(rc->clque, rc->clkrn, dims, NULL,
+								 global_work_size, rc->local_work_size,
+								 1, &ready, &rendered);
+	OCLCHECK(ret);
+
+	// The writer takes over the buffer once the readback is done. The image
+	// is sized for the largest metatile, only its corner gets rendered.
+	slot->tile = malloc(slot->njobs * tilelen * sizeof(uint8_t));
+	ret = clEnqueueReadImage(rc->clque, slot->tile_cl, CL_FALSE,
+							 (size_t[3]){0, 0, 0},
+							 (size_t[3]){rc->tilesize, rc->tilesize, slot->njobs},
+							 0, 0, slot->tile, 1, &rendered, &slot->done);
+	OCLCHECK(ret);
+	clReleaseEvent(ready);
+	clReleaseEvent(rendered);
+	clFlush(rc->clque);
+
+	rc->nextslot = (rc->nextslot + 1) % PIPELINE_DEPTH;
+}
+
+// Compares a sample of the tiles of the zoomlevel to the exact kernel
+static void approx_check(struct render_ctx *rc)
+{
+	struct tile_queue *queue = rc->queue;
+	struct tile_slot *slot = &rc->slots[0];
+	size_t tilelen = (size_t)rc->tilesize * rc->tilesize;
+	uint8_t *approx = malloc(2 * tilelen * sizeof(uint8_t));
+	uint8_t *exact = approx + tilelen;
+
+	size_t nsamples = 0;
+	int maxdiff = 0;
+	double sumdiff = 0.0;
+	size_t ndiff = 0;
+	size_t stride = max(queue->len / SAMPLE_TILES, (size_t)1);
+	for (size_t i = 0; i < queue->len && nsamples < SAMPLE_TILES; i += stride) {
+		const struct tile_job *job = &queue->jobs[i];
+		cl_uint npts;
+		slot->nranges = 0;
+		cl_uint nranges = tile_ranges(rc, job, slot, &npts);
+		if (npts == 0) {
+			continue;
+		}
+		nsamples++;
+
+		approx_render_tile(&rc->approxkrn, job->tr, nranges, slot->ranges,
+						   rc->pts, rc->vals, approx);
+		cpu_render_tile(&rc->approxkrn.exact, job->tr, nranges, slot->ranges,
+						rc->pts, rc->vals, exact);
+		for (size_t p = 0; p < tilelen; p++) {
+			int diff = abs(approx[p] - exact[p]);
+			maxdiff = max(maxdiff, diff);
+			sumdiff += diff;
+			ndiff += diff > 1;
+		}
+	}
+	free(approx);
+
+	if (nsamples > 0) {
+		log_info("Approximation error on zoomlevel %d over %zu tiles: at most %d colors, "
+				 "%.3f on average, %.2f%% of the pixels off by more than one",
+				 queue->zoom, nsamples, maxdiff,
+				 sumdiff / (nsamples * tilelen), 100.0 * ndiff / (nsamples * tilelen));
+	}
+}
+
+static void *render_worker(void *arg)
+{
+	struct render_ctx *rc = arg;
+	struct tile_queue *queue = rc->queue;
+
+	rc->tquery = 0.0;
+	rc->ntiles = 0;
+	rc->stats = (struct render_stats){ 0 };
+	rc->status = prepare_kernel(rc, queue->zoom);
+	if (rc->status) {
+		return NULL;
+	}
+	// The other threads carry on rendering meanwhile
+	if (rc->backend == BACKEND_APPROX && rc->args->approx_check && rc->index == 0) {
+		approx_check(rc);
+	}
+
+	size_t i;
+	while ((i = __atomic_fetch_add(&queue->next, rc->batch, __ATOMIC_RELAXED)) < queue->len) {
+		size_t n = min(rc->batch, queue->len - i);
+		render_batch(rc, &queue->jobs[i], n);
+		rc->ntiles += n;
+	}
+	// Drain the pipeline, oldest tile first
+	for (unsigned i = 0; i < PIPELINE_DEPTH; i++) {
+		slot_retire(rc, &rc->slots[(rc->nextslot + i) % PIPELINE_DEPTH]);
+	}
+
+	return NULL;
+}
+
+// Picks the lowest transform order which keeps the metatiles within
+// args->transform_error pixels. The error is sampled on a grid of metatiles
+// across the area, the edges included, as it grows away from the center of
+// the projection.
+static int zoom_transform_order(struct arguments *args, int zoom, int metazoom,
+								unsigned int mleft, unsigned int mtop,
+								unsigned int mright, unsigned int mbot)
+{
+	if (args->transform_order != 0) {
+		return args->transform_order;
+	}
+	if (args->kproj.type != KERNEL_PROJECTION_NONE) {
+		// The kernels project exactly, the transforms only bound the tiles
+		return TRANSFORM_QUADRATIC;
+	}
+
+	int tilesize = TILE_SIZE * zoom_metatile(args, zoom);
+	cl_float2 errs[ORDER_SAMPLE_POINTS];
+	float worst = 0.0f;
+	for (int order = TRANSFORM_AFFINE; order <= TRANSFORM_QUADRATIC; order++) {
+		// The same points for both orders
+		unsigned int seed = 2;
+		worst = 0.0f;
+		for (unsigned int i = 0; i < ORDER_SAMPLE_SIDE; i++) {
+			for (unsigned int j = 0; j < ORDER_SAMPLE_SIDE; j++) {
+				unsigned int mx = mleft + (mright - 1 - mleft) * i / (ORDER_SAMPLE_SIDE - 1);
+				unsigned int my = mtop + (mbot - 1 - mtop) * j / (ORDER_SAMPLE_SIDE - 1);
+				float side;
+				if (sample_transform_errors(mx, my, metazoom, order, ARRAY_SIZE(errs), &seed,
+											errs, &side, args->proj_meters)) {
+					return TRANSFORM_QUADRATIC;
+				}
+				for (size_t k = 0; k < ARRAY_SIZE(errs); k++) {
+					worst = max(worst, hypotf(errs[k].x, errs[k].y) / side * tilesize);
+				}
+			}
+		}
+		if (worst <= args->transform_error) {
+			if (order != TRANSFORM_AFFINE) {
+				log_info("Zoomlevel %d: using quadratic tile transforms, off by up to %.3f pixels",
+						 zoom, worst);
+			}
+			return order;
+		}
+	}
+	log_info("Zoomlevel %d: the tile transforms are off by up to %.3f pixels, "
+			 "smaller metatiles would be more precise", zoom, worst);
+	return TRANSFORM_QUADRATIC;
+}
+
+static int render_zoom(struct render_ctx *rcs, size_t nrcs, int zoom, uint64_t confighash,
+					   struct render_stats *total)
+{
+	struct arguments *args = rcs[0].args;
+
+	struct rect tilebounds = rect_make(
+			wgs84_to_tile(args->bounds.lt, zoom),
+			wgs84_to_tile(args->bounds.rb, zoom));
+	tilebounds.lt = round_point(tilebounds.lt, 1, false);
+	tilebounds.rb = round_point(tilebounds.rb, 1, true);
+
+	// Render tiles
+	log_info("Rendering tiles from (%d,%d) to (%d,%d) on zoomlevel %d",
+			 (int)rect_left(tilebounds), (int)rect_top(tilebounds),
+			 (int)rect_right(tilebounds), (int)rect_bot(tilebounds),
+			 zoom);
+
+	char zpath[PATH_MAX];
+	snprintf(zpath, sizeof(zpath), "%s/%d", args->outdir, zoom);
+	if (mkdir(zpath, 0755) && errno != EEXIST) {
+		log_error_errno("Failed to create the zoomlevel directory %s", zpath);
+		return -1;
+	}
+
+	char manifestpath[PATH_MAX];
+	snprintf(manifestpath, sizeof(manifestpath), "%s/manifest.txt", zpath);
+	struct manifest manifest;
+	if (manifest_load(&manifest, manifestpath)) {
+		return -1;
+	}
+
+	// The transforms and bounds of all the tiles are computed before the
+	// devices start
+	unsigned int left = rect_left(tilebounds);
+	unsigned int top = rect_top(tilebounds);
+	unsigned int right = (unsigned int)rect_right(tilebounds) + 1;
+	unsigned int bot = (unsigned int)rect_bot(tilebounds) + 1;
+	// An aligned metatile is exactly one tile a few zoomlevels up, so its
+	// transform and bounds come from there
+	unsigned int metatile = zoom_metatile(args, zoom);
+	int metazoom = zoom;
+	while ((1u << (zoom - metazoom)) < metatile) {
+		metazoom--;
+	}
+	unsigned int mleft = left / metatile;
+	unsigned int mtop = top / metatile;
+	unsigned int mright = (right - 1) / metatile + 1;
+	unsigned int mbot = (bot - 1) / metatile + 1;
+	struct tile_queue queue = {
+		.zoom = zoom,
+		.metatile = metatile,
+		.left = left,
+		.top = top,
+		.right = right,
+		.bot = bot,
+		.confighash = hash_bytes(confighash, &args->zooms[zoom].range,
+								 sizeof(args->zooms[zoom].range)),
+		.manifest = &manifest,
+		.jobs = calloc((size_t)(mright - mleft) * (mbot - mtop), sizeof(struct tile_job)),
+		.len = 0,
+		.next = 0,
+	};
+	struct transform_store transforms;
+	if (queue.jobs == NULL) {
+		log_error("Failed to allocate the tile queue");
+		manifest_free(&manifest);
+		return -1;
+	}
+	// The great circle kernels compute the pixel positions on their own and
+	// need no fitted transforms
+	if (!args->great_circle) {
+		int order = zoom_transform_order(args, zoom, metazoom, mleft, mtop, mright, mbot);
+		if (transform_store_open(&transforms, args->outdir, args->projdef, metazoom, order,
+								 mleft, mtop, mright, mbot)) {
+			free(queue.jobs);
+			manifest_free(&manifest);
+			return -1;
+		}
+		size_t ngenerated = 0;
+		double tgen = time_monotonic();
+		if (fill_transform_store(&transforms, mleft, mtop, mright, mbot, args->proj_meters,
+								 &ngenerated)) {
+			transform_store_close(&transforms);
+			free(queue.jobs);
+			manifest_free(&manifest);
+			return -1;
+		}
+		if (ngenerated > 0) {
+			log_info("Generated %zu tile transforms in %.3fs", ngenerated,
+					 time_monotonic() - tgen);
+		}
+	}
+	for (unsigned int mx = mleft; mx < mright; mx++) {
+		for (unsigned int my = mtop; my < mbot; my++) {
+			struct tile_job *job = &queue.jobs[queue.len++];
+			job->tx = mx * metatile;
+			job->ty = my * metatile;
+			if (args->great_circle) {
+				job->bounds = tile_bounds_wgs84(mx, my, metazoom, zoom_prefilter(args, zoom));
+			} else {
+				memcpy(job->tr, transform_store_get(&transforms, mx, my), sizeof(job->tr));
+				job->bounds = tile_bounds_meters(job->tr, zoom_prefilter(args, zoom));
+			}
+			// For the positions computed on the device, see tile_to_projected
+			// and tile_to_wgs84
+			if (args->great_circle || args->kproj.type != KERNEL_PROJECTION_NONE) {
+				job->tr[0].s[6] = mx;
+				job->tr[0].s[7] = my;
+				job->tr[1].s[6] = 1u << metazoom;
+			}
+		}
+	}
+	if (!args->great_circle) {
+		transform_store_close(&transforms);
+	}
+
+	// The first device runs on this thread
+	for (size_t i = 0; i < nrcs; i++) {
+		rcs[i].queue = &queue;
+	}
+	for (size_t i = 1; i < nrcs; i++) {
+		rcs[i].started = !pthread_create(&rcs[i].thread, NULL, render_worker, &rcs[i]);
+		if (!rcs[i].started) {
+			log_error("Failed to start the thread of device %s", rcs[i].devname);
+		}
+	}
+	render_worker(&rcs[0]);
+
+	int status = 0;
+	double tquery = 0.0;
+	struct render_stats stats = { 0 };
+	for (size_t i = 0; i < nrcs; i++) {
+		if (rcs[i].started) {
+			pthread_join(rcs[i].thread, NULL);
+			rcs[i].started = false;
+		}
+		status |= rcs[i].status;
+		tquery += rcs[i].tquery;
+		stats.rendered += rcs[i].stats.rendered;
+		stats.skipped += rcs[i].stats.skipped;
+		stats.removed += rcs[i].stats.removed;
+		if (nrcs > 1 && rcs[i].backend == BACKEND_OPENCL) {
+			log_info("Device %s rendered %zu tiles", rcs[i].devname, rcs[i].ntiles);
+		}
+	}
+	// The manifest may only take the tiles which made it to the disk, and the
+	// writer points into the jobs
+	writer_flush(rcs[0].writer);
+	size_t nfailed = 0;
+	for (size_t i = 0; i < queue.len; i++) {
+		if (queue.jobs[i].failed > 0) {
+			// Rendered again by the next run
+			queue.jobs[i].hash = 0;
+			nfailed++;
+		}
+	}
+	if (nfailed > 0) {
+		log_error("Zoomlevel %d: failed to write the tiles of %zu (meta)tiles", zoom, nfailed);
+	}
+	log_info("Zoomlevel %d: rendered %zu, skipped %zu unchanged and removed %zu (meta)tiles",
+			 zoom, stats.rendered, stats.skipped, stats.removed);
+	total->rendered += stats.rendered;
+	total->skipped += stats.skipped;
+	total->removed += stats.removed;
+
+	// A failed run might have left some of the tiles out
+	if (status == 0) {
+		struct manifest updated = {
+			.entries = malloc(queue.len * sizeof(struct manifest_entry)),
+			.len = queue.len,
+		};
+		if (updated.entries != NULL) {
+			for (size_t i = 0; i < queue.len; i++) {
+				updated.entries[i] = (struct manifest_entry){
+					.tx = queue.jobs[i].tx,
+					.ty = queue.jobs[i].ty,
+					.hash = queue.jobs[i].hash,
+				};
+			}
+			if (manifest_merge(&updated, &manifest) == 0) {
+				manifest_save(&updated, manifestpath);
+			}
+		}
+		manifest_free(&updated);
+	}
+	manifest_free(&manifest);
+	free(queue.jobs);
+
+	if (rcs[0].grid != NULL) {
+		log_info("Point grid queries took %.3fs in total", tquery);
+	}
+
+	return status;
+}
+
+// The projection on the device needs doubles, see kernels/projection.h
+static bool device_has_doubles(cl_device_id devid)
+{
+	size_t len = 0;
+	if (clGetDeviceInfo(devid, CL_DEVICE_EXTENSIONS, 0, NULL, &len) != CL_SUCCESS) {
+		return false;
+	}
+	char exts[len + 1];
+	exts[len] = '\0';
+	if (clGetDeviceInfo(devid, CL_DEVICE_EXTENSIONS, len, exts, NULL) != CL_SUCCESS) {
+		return false;
+	}
+	return strstr(exts, "cl_khr_fp64") != NULL;
+}
+
+// Resolves the device selection to the device ids, returns their count
+static size_t select_devices(struct arguments *args, cl_device_id *out, size_t maxlen)
+{
+	cl_platform_id pids[10];
+	cl_uint npids;
+	if (clGetPlatformIDs(ARRAY_SIZE(pids), pids, &npids) != CL_SUCCESS) {
+		npids = 0;
+	}
+
+	size_t len = 0;
+	if (args->all_devices) {
+		for (cl_uint p = 0; p < npids && len < maxlen; p++) {
+			cl_uint ndids;
+			if (clGetDeviceIDs(pids[p], CL_DEVICE_TYPE_ALL, maxlen - len,
+							   out + len, &ndids) == CL_SUCCESS) {
+				len += min((size_t)ndids, maxlen - len);
+			}
+		}
+		if (len == 0) {
+			log_error("No OpenCL devices found!");
+		}
+		return len;
+	}
+
+	for (size_t i = 0; i < args->ndevices; i++) {
+		struct device_spec *spec = &args->devices[i];
+		log_debug("Attempting to use platform = %d and device = %d",
+				  spec->platformid, spec->deviceid);
+		if (spec->platformid >= npids) {
+			log_error("Platform id = %d not found!", spec->platformid);
+			return 0;
+		}
+		cl_device_id dids[10];
+		cl_uint ndids;
+		if (clGetDeviceIDs(pids[spec->platformid], CL_DEVICE_TYPE_ALL,
+						   ARRAY_SIZE(dids), dids, &ndids) != CL_SUCCESS) {
+			ndids = 0;
+		}
+		if (spec->deviceid >= ndids) {
+			log_error("Device id = %d not found!", spec->deviceid);
+			return 0;
+		}
+		out[len++] = dids[spec->deviceid];
+	}
+	return len;
+}
+
+// Checks that the device can hold the images of --metatile and --batch
+static int check_image_limits(struct render_ctx *rc)
+{
+	size_t side = TILE_SIZE * rc->args->metatile;
+	size_t maxwidth = 0, maxheight = 0, maxlayers = 1;
+	cl_ulong maxalloc = 0;
+	clGetDeviceInfo(rc->devid, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(maxwidth), &maxwidth, NULL);
+	clGetDeviceInfo(rc->devid, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(maxheight), &maxheight, NULL);
+	clGetDeviceInfo(rc->devid, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxalloc), &maxalloc, NULL);
+	if (rc->batch > 1) {
+		clGetDeviceInfo(rc->devid, CL_DEVICE_IMAGE_MAX_ARRAY_SIZE, sizeof(maxlayers),
+						&maxlayers, NULL);
+	}
+	if (side > maxwidth || side > maxheight) {
+		log_error("Device %s supports images up to %zux%zu, --metatile %u needs %zux%zu",
+				  rc->devname, maxwidth, maxheight, rc->args->metatile, side, side);
+		return -1;
+	}
+	if (rc->batch > maxlayers) {
+		log_error("Device %s supports image arrays of up to %zu layers, --batch is %zu",
+				  rc->devname, maxlayers, rc->batch);
+		return -1;
+	}
+	if ((cl_ulong)rc->batch * side * side > maxalloc) {
+		log_error("Device %s can allocate up to %" PRIu64 "MB at once, the tiles of --metatile %u "
+				  "--batch %zu take %zuMB", rc->devname, (uint64_t)(maxalloc >> 20),
+				  rc->args->metatile, rc->batch, (rc->batch * side * side) >> 20);
+		return -1;
+	}
+	return 0;
+}
+
+// Creates the context, queue and buffers of the device
+static int render_ctx_init(struct render_ctx *rc, uint64_t srchash,
+						   cl_float2 *pts, float *vals)
+{
+	for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+		struct tile_slot *slot = &rc->slots[i];
+		slot->tile = NULL;
+		slot->rangescap = slot->clrangescap = SLOT_RANGES * rc->batch;
+		slot->ranges = calloc(slot->rangescap, sizeof(cl_uint2));
+		slot->ends = calloc(slot->rangescap, sizeof(cl_uint));
+		if (slot->ranges == NULL || slot->ends == NULL) {
+			log_error("Failed to allocate the point ranges");
+			return -1;
+		}
+	}
+	// The host points are hashed for the manifest with any backend
+	rc->pts = pts;
+	rc->vals = vals;
+	if (rc->backend != BACKEND_OPENCL) {
+		snprintf(rc->devname, sizeof(rc->devname), "cpu%u", rc->index);
+		return 0;
+	}
+
+	cl_platform_id platform;
+	clGetDeviceInfo(rc->devid, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+	char platname[500];
+	clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(platname), platname, NULL);
+	char platver[500];
+	clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(platver), platver, NULL);
+	log_info("OpenCL Platform %s  %s", platname, platver);
+
+	clGetDeviceInfo(rc->devid, CL_DEVICE_NAME, sizeof(rc->devname), rc->devname, NULL);
+	char devver[500];
+	clGetDeviceInfo(rc->devid, CL_DEVICE_VERSION, sizeof(devver), devver, NULL);
+	log_info("OpenCL Device %s  %s", rc->devname, devver);
+	char drvver[500];
+	clGetDeviceInfo(rc->devid, CL_DRIVER_VERSION, sizeof(drvver), drvver, NULL);
+
+	rc->prghash = hash_str(srchash, platname);
+	rc->prghash = hash_str(rc->prghash, rc->devname);
+	rc->prghash = hash_str(rc->prghash, devver);
+	rc->prghash = hash_str(rc->prghash, drvver);
+	if (check_image_limits(rc)) {
+		return -1;
+	}
+
+	cl_int ret;
+	rc->clctx = clCreateContext(NULL, 1, &rc->devid, NULL, NULL, &ret);
+	OCLCHECK(ret);
+	// The tiles in flight are ordered by events, so let the device reorder
+	// the commands if it can
+	rc->clque = clCreateCommandQueue(rc->clctx, rc->devid,
+			CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &ret);
+	if (ret == CL_INVALID_VALUE || ret == CL_INVALID_QUEUE_PROPERTIES) {
+		rc->clque = clCreateCommandQueue(rc->clctx, rc->devid, 0, &ret);
+	}
+	OCLCHECK(ret);
 
 	const cl_image_format imformat = { CL_R, CL_UNSIGNED_INT8 };
 	const cl_image_desc imdesc = {
-		.image_type = CL_MEM_OBJECT_IMAGE2D,
-		.image_width = TILE_SIZE,
-		.image_height = TILE_SIZE,
+		.image_type = rc->batch > 1 ? CL_MEM_OBJECT_IMAGE2D_ARRAY : CL_MEM_OBJECT_IMAGE2D,
+		.image_width = TILE_SIZE * rc->args->metatile,
+		.image_height = TILE_SIZE * rc->args->metatile,
 		.image_depth = 0,
-		.image_array_size = 1,
+		.image_array_size = rc->batch,
 		.image_row_pitch = 0,
 		.image_slice_pitch = 0,
 		.num_samples = 0,
 		.buffer = NULL
 	};
-	size_t tile_len = TILE_SIZE * TILE_SIZE * sizeof(uint8_t);
-	uint8_t *tile = malloc(tile_len);
-	cl_mem tile_cl = clCreateImage(clctx, CL_MEM_WRITE_ONLY, &imformat, &imdesc, NULL, &ret);
+	// All the points are uploaded just once, the tiles then only pass ranges
+	// of the (grid sorted) point array to the kernel
+	rc->pts_cl = clCreateBuffer(rc->clctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+								rc->datalen * sizeof(cl_float2), pts, &ret);
 	OCLCHECK(ret);
-	// Note that we allocate the upper-bound of input points, this should not be
-	// a lot of memory anyway
-	cl_float2 *chosenpts = calloc(datalen, sizeof(cl_float2));
-	cl_mem pts_cl = clCreateBuffer(clctx, CL_MEM_READ_ONLY, datalen * sizeof(cl_float2),
-								   NULL, &ret);
-	OCLCHECK(ret);
-	float *chosenvals = calloc(datalen, sizeof(float));
-	cl_mem vals_cl = clCreateBuffer(clctx, CL_MEM_READ_ONLY, datalen * sizeof(cl_float),
-									NULL, &ret);
+	rc->vals_cl = clCreateBuffer(rc->clctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+								 rc->datalen * sizeof(cl_float), vals, &ret);
 	OCLCHECK(ret);
+	for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+		struct tile_slot *slot = &rc->slots[i];
+		slot->ranges_cl = clCreateBuffer(rc->clctx, CL_MEM_READ_ONLY,
+										 slot->clrangescap * sizeof(cl_uint2), NULL, &ret);
+		OCLCHECK(ret);
+		slot->trx_cl = slot->try_cl = slot->batch_cl = NULL;
+		if (rc->batch > 1) {
+			slot->trx_cl = clCreateBuffer(rc->clctx, CL_MEM_READ_ONLY,
+										  rc->batch * sizeof(cl_float8), NULL, &ret);
+			OCLCHECK(ret);
+			slot->try_cl = clCreateBuffer(rc->clctx, CL_MEM_READ_ONLY,
+										  rc->batch * sizeof(cl_float8), NULL, &ret);
+			OCLCHECK(ret);
+			slot->batch_cl = clCreateBuffer(rc->clctx, CL_MEM_READ_ONLY,
+											rc->batch * sizeof(cl_uint2), NULL, &ret);
+			OCLCHECK(ret);
+		}
+		slot->tile_cl = clCreateImage(rc->clctx, CL_MEM_WRITE_ONLY, &imformat,
+									  &imdesc, NULL, &ret);
+		OCLCHECK(ret);
+		// See alloc_splat_buffers
+		slot->accum_cl = slot->ends_cl = NULL;
+	}
+	return 0;
+}
+
+static void render_ctx_release(struct render_ctx *rc)
+{
+	for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+		free(rc->slots[i].ranges);
+		free(rc->slots[i].ends);
+	}
+	if (rc->backend == BACKEND_APPROX) {
+		approx_kernel_free(&rc->approxkrn);
+	}
+	if (rc->backend != BACKEND_OPENCL) {
+		return;
+	}
+
+	clFlush(rc->clque);
+	clFinish(rc->clque);
+	if (rc->clprg != NULL) {
+		if (rc->splatkrn != NULL) {
+			clReleaseKernel(rc->splatkrn);
+		}
+		clReleaseKernel(rc->clkrn);
+		clReleaseProgram(rc->clprg);
+	}
+	for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+		clReleaseMemObject(rc->slots[i].ranges_cl);
+		clReleaseMemObject(rc->slots[i].tile_cl);
+		if (rc->slots[i].accum_cl != NULL) {
+			clReleaseMemObject(rc->slots[i].accum_cl);
+			clReleaseMemObject(rc->slots[i].ends_cl);
+		}
+		if (rc->batch > 1) {
+			clReleaseMemObject(rc->slots[i].trx_cl);
+			clReleaseMemObject(rc->slots[i].try_cl);
+			clReleaseMemObject(rc->slots[i].batch_cl);
+		}
+	}
+	clReleaseMemObject(rc->vals_cl);
+	clReleaseMemObject(rc->pts_cl);
+	clReleaseCommandQueue(rc->clque);
+	clReleaseContext(rc->clctx);
+}
+
+int main(int argc, char *argv[])
+{
+	struct arguments args = {
+		.backend = BACKEND_OPENCL,
+		.zoommin = 12,
+		.zoommax = 12,
+		.devices = { { .platformid = 0, .deviceid = 0 } },
+		.ndevices = 1,
+		.all_devices = false,
+		.kernel = NULL,
+		.inpath = "./input.json",
+		.outdir = "./cache",
+		.clargs = "",
+		.bounds_defined = false,
+		.colormap = colormap_heat,
+		.proj_meters = NULL,
+		.prefilter = INFINITY,
+		.encode_threads = max(sysconf(_SC_NPROCESSORS_ONLN), 1L),
+		.metatile = 1,
+		.batch = 1,
+		.transform_order = 0,
+		.transform_error = 0.25f,
+		.host_projection = false,
+		.kproj = { .type = KERNEL_PROJECTION_NONE },
+		.great_circle = false,
+	};
+	for (size_t i = 0; i < ARRAY_SIZE(args.zooms); i++) {
+		args.zooms[i] = (struct zoom_params){ .range = NAN, .prefilter = NAN };
+	}
+
+	argp_parse(&argp, argc, argv, 0, 0, &args);
+
+	if (args.kernel == NULL) {
+		fprintf(stderr, "No kernel specified. Select on from the kernels/ directory!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!args.bounds_defined) {
+		fprintf(stderr, "No boundaries specified!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (args.great_circle && args.backend != BACKEND_OPENCL) {
+		fprintf(stderr, "Great circle distances are only supported by the OpenCL backend!\n");
+		return EXIT_FAILURE;
+	}
+
+	init_projs();
+
+	if (args.proj_meters == NULL) {
+		args.proj_meters = pj_init_plus("+init=epsg:3045");
+	}
+	char *projdef = proj_definition(args.proj_meters);
+	args.projdef = projdef;
+
+	char *kpath = NULL;
+	char *clsrc = NULL;
+	char *kdir = ".";
+	uint64_t srchash = HASH_INIT;
+	cl_device_id devids[MAX_DEVICES];
+	size_t nrcs;
+	if (args.backend == BACKEND_OPENCL) {
+		// Load the kernel, it gets built for each zoomlevel as needed
+		clsrc = load_kernel(args.kernel, &kpath);
+
+		if (!clsrc) {
+			return EXIT_FAILURE;
+		}
+
+		log_info("Loaded kernel from %s", kpath);
+		kdir = dirname(kpath);
+		srchash = hash_kernel_source(clsrc, kdir);
+
+		log_warn("Starting OpenCL!");
+
+		nrcs = select_devices(&args, devids, ARRAY_SIZE(devids));
+		if (nrcs == 0) {
+			return EXIT_FAILURE;
+		}
+
+		// Transverse Mercator and Mercator get projected exactly by the
+		// kernels, the rest goes through proj4 and the fitted transforms
+		if (!args.host_projection && !args.great_circle &&
+				kernel_projection_init(&args.kproj, args.proj_meters) == 0) {
+			for (size_t i = 0; i < nrcs; i++) {
+				if (!device_has_doubles(devids[i])) {
+					log_info("Not all the devices have doubles, projecting on the host");
+					memset(&args.kproj, 0, sizeof(args.kproj));
+					break;
+				}
+			}
+		}
+		if (args.kproj.type != KERNEL_PROJECTION_NONE) {
+			log_info("Projecting with the kernels instead of proj4");
+		}
+	} else {
+		// One renderer per CPU, taking the tiles from the same queue the
+		// OpenCL devices do, for both the exact and the approximate kernels
+		nrcs = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+		log_info("Rendering on %zu CPU threads", nrcs);
+	}
+
+	// Load the input points
+	struct points points;
+	if (fetch_points(&args, args.backend == BACKEND_OPENCL ? devids[0] : NULL, kdir, &points)) {
+		return EXIT_FAILURE;
+	}
+	size_t datalen = points.len;
+	cl_float2 *datapts = points.pts;
+	float *datavals = points.vals;
+
+	// Without a prefilter every tile gets all the points, so there is no
+	// point in the grid
+	bool use_grid = false;
+	float minprefilter = INFINITY;
+	for (int zoom = args.zoommin; zoom <= args.zoommax; zoom++) {
+		use_grid |= isfinite(zoom_prefilter(&args, zoom));
+		minprefilter = min(minprefilter, zoom_prefilter(&args, zoom));
+	}
+	// The points are in radians with great circle distances, see
+	// tile_bounds_wgs84
+	if (args.great_circle) {
+		minprefilter /= EARTH_RADIUS;
+	}
+	double tstart = time_monotonic();
+	struct grid grid;
+	// The reference point of the tdoa kernel
+	cl_uint refpt = 0;
+	if (use_grid) {
+		if (grid_build(&grid, datapts, datavals, datalen, minprefilter, &refpt)) {
+			return EXIT_FAILURE;
+		}
+		log_info("Point grid built in %.3fs", time_monotonic() - tstart);
+	}
+
+	struct tile_writer writer;
+	if (writer_start(&writer, args.encode_threads, TILE_SIZE, TILE_SIZE,
+					 args.colormap)) {
+		return EXIT_FAILURE;
+	}
 
 	char blankfilepath[PATH_MAX];
 	snprintf(blankfilepath, sizeof(blankfilepath), "%s/blank.png", args.outdir);
-	// We are going to be overwriting the file a few times for different zooms, solve that maybe?
+
+	struct render_ctx *rcs = calloc(nrcs, sizeof(struct render_ctx));
+	for (size_t i = 0; i < nrcs; i++) {
+		rcs[i] = (struct render_ctx){
+			.index = i,
+			.backend = args.backend,
+			.args = &args,
+			.devid = args.backend == BACKEND_OPENCL ? devids[i] : NULL,
+			.clsrc = clsrc,
+			.kdir = kdir,
+			.clprg = NULL,
+			.batch = args.backend == BACKEND_OPENCL ? args.batch : 1,
+			.nextslot = 0,
+			.writer = &writer,
+			.datalen = datalen,
+			.grid = use_grid ? &grid : NULL,
+			.refpt = refpt,
+		};
+		strlcpy(rcs[i].blankfilepath, blankfilepath, sizeof(rcs[i].blankfilepath));
+		if (render_ctx_init(&rcs[i], srchash, datapts, datavals)) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	// All the empty tiles get linked to the blank one, so nothing can be
+	// rendered without it
+	char outpath[PATH_MAX];
+	strlcpy(outpath, args.outdir, sizeof(outpath));
+	if (mkdir_recursive(outpath, 0755)) {
+		log_error_errno("Failed to create the output directory %s", args.outdir);
+		return EXIT_FAILURE;
+	}
 	FILE *file = fopen(blankfilepath, "wb");
 	if (file == NULL) {
-		// Otherwise, just ignore that, the link() calls later are going to fail, but meh
 		log_error_errno("Failed to save the blank tile!");
-	} else {
-		fwrite(blank_tile_png, 1, sizeof(blank_tile_png), file);
-		fclose(file);
-	}
-
-	for (unsigned int tx = rect_left(tilebounds); tx <= rect_right(tilebounds); tx++) {
-		for (unsigned int ty = rect_top(tilebounds); ty <= rect_bot(tilebounds); ty++) {
-			log_info("Processing (%d,%d)", tx, ty);
-			cl_float4 tr[2];
-			fetch_tile_transform(args.zoomlevel, tx, ty, args.outdir,
-								 args.proj_meters, tr);
-
-			// Now we attempt to filter out points which are too far away to make
-			// any difference for the tile values
-			struct rect tilet = rect_make((cl_float2){ .x = tx	  , .y = ty	   },
-										  (cl_float2){ .x = tx + 1, .y = ty + 1});
-			// Okay, so we can't just transform the left-top and right-bottom corners
-			// here and call it a day as the tile->meters coordinate transformation
-			// would need to have axis in the same direction.
-			// As we don't care about some extra points being included, we
-			// just take the maximum boundary.
-			cl_float2 ptstile[4] = {
-				rect_lefttop(tilet), rect_righttop(tilet),
-				rect_rightbot(tilet), rect_leftbot(tilet),
-			};
-			cl_float2 ptsms[4];
-			for (size_t i = 0; i < ARRAY_SIZE(ptsms); i++) {
-				ptsms[i] = tile_to_meters(ptstile[i], args.zoomlevel,
-										  args.proj_meters);
-			}
-			struct rect tilems = rect_max(ptsms, ARRAY_SIZE(ptsms));
-			tilems = rect_inflate(tilems, args.prefilter);
-
-			cl_uint npts = 0;
-			for (size_t i = 0; i < datalen; i++) {
-				if (!rect_is_inside(tilems, datapts[i])) {
-					continue;
-				}
-				chosenpts[npts] = datapts[i];
-				chosenvals[npts] = datavals[i];
-				npts++;
-			}
+		return EXIT_FAILURE;
+	}
+	size_t nblank = fwrite(blank_tile_png, 1, sizeof(blank_tile_png), file);
+	if (fclose(file) || nblank != sizeof(blank_tile_png)) {
+		log_error_errno("Failed to save the blank tile!");
+		return EXIT_FAILURE;
+	}
 
-			char path[PATH_MAX];
-			snprintf(path, sizeof(path),
-					"%s/%d/%d/%d.png", args.outdir, args.zoomlevel, tx, ty);
-
-			bzero(tile, TILE_SIZE * TILE_SIZE);
-			if (npts != 0) {
-				log_info(" generating from %d...", npts);
-				clEnqueueWriteBuffer(clque, pts_cl, CL_TRUE, 0, npts * sizeof(chosenpts[0]),
-									 chosenpts, 0, NULL, NULL);
-				clEnqueueWriteBuffer(clque, vals_cl, CL_TRUE, 0, npts * sizeof(chosenvals[0]),
-									 chosenvals, 0, NULL, NULL);
-
-				ret = clSetKernelArg(clkrn, 0, sizeof(tr[0]), &tr[0]);
-				OCLCHECK(ret);
-				ret = clSetKernelArg(clkrn, 1, sizeof(tr[1]), &tr[1]);
-				OCLCHECK(ret);
-				ret = clSetKernelArg(clkrn, 2, sizeof(npts), &npts);
-				OCLCHECK(ret);
-				ret = clSetKernelArg(clkrn, 3, sizeof(pts_cl), &pts_cl);
-				OCLCHECK(ret);
-				ret = clSetKernelArg(clkrn, 4, sizeof(vals_cl), &vals_cl);
-				OCLCHECK(ret);
-				ret = clSetKernelArg(clkrn, 5, sizeof(tile_cl), &tile_cl);
-				OCLCHECK(ret);
+	// Everything the tiles depend on besides the points and the transforms,
+	// the zoomlevels add their RANGE
+	uint64_t confighash = hash_str(srchash, args.kernel);
+	confighash = hash_str(confighash, args.clargs);
+	confighash = hash_bytes(confighash, &args.backend, sizeof(args.backend));
+	confighash = hash_bytes(confighash, &args.metatile, sizeof(args.metatile));
+	confighash = hash_bytes(confighash, &args.kproj, sizeof(args.kproj));
+	confighash = hash_bytes(confighash, &args.great_circle, sizeof(args.great_circle));
+	confighash = hash_bytes(confighash, args.colormap, COLORMAP_LEN * sizeof(rgba_t));
+	if (datalen > 0) {
+		// The tdoa tiles depend on the reference point, wherever it is
+		confighash = hash_bytes(confighash, &datapts[refpt], sizeof(datapts[refpt]));
+	}
 
-				size_t global_work_size[] = { TILE_SIZE, TILE_SIZE };
-				size_t local_work_size[] = { 1, 1 };
-				ret = clEnqueueNDRangeKernel(clque, clkrn, 2, NULL,
-											 global_work_size, local_work_size,
-											 0, NULL, NULL);
-				OCLCHECK(ret);
-				clFinish(clque);
-
-				// Read the image and save to a file
-				clEnqueueReadImage(clque, tile_cl, CL_TRUE,
-								  (size_t[3]){0, 0, 0},
-								  (size_t[3]){TILE_SIZE, TILE_SIZE, 1},
-								  0, 0, tile, 0, NULL, NULL);
-
-				write_png(path, TILE_SIZE, TILE_SIZE,
-						  tile,
-						  args.colormap);
-				log_info(" wrote %s", path);
-			} else {
-				log_info(" skipping...");
-				link(blankfilepath, path);
-				log_info(" linked %s to %s", path, blankfilepath);
-			}
+	int status = EXIT_SUCCESS;
+	struct render_stats total = { 0 };
+	for (int zoom = args.zoommin; zoom <= args.zoommax; zoom++) {
+		if (render_zoom(rcs, nrcs, zoom, confighash, &total)) {
+			status = EXIT_FAILURE;
+			break;
 		}
 	}
+	log_info("Rendered %zu, skipped %zu unchanged and removed %zu (meta)tiles in total",
+			 total.rendered, total.skipped, total.removed);
 
-	ret = clFlush(clque);
-	ret = clFinish(clque);
-	ret = clReleaseKernel(clkrn);
-	ret = clReleaseProgram(clprg);
-	ret = clReleaseMemObject(vals_cl);
-	ret = clReleaseMemObject(pts_cl);
-	ret = clReleaseMemObject(tile_cl);
-	ret = clReleaseContext(clctx);
+	writer_finish(&writer);
+	for (size_t i = 0; i < nrcs; i++) {
+		render_ctx_release(&rcs[i]);
+	}
+	free(rcs);
 
-	free(chosenvals);
-	free(chosenpts);
-	free(tile);
+	points_free(&points);
+	free(projdef);
+	if (use_grid) {
+		grid_free(&grid);
+	}
 	free(clsrc);
+	free(kpath);
+
+	return status;
 }
@@ -0,0 +1,153 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#include "manifest.h"
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct manifest_entry *ea = a;
+	const struct manifest_entry *eb = b;
+	if (ea->tx != eb->tx) {
+		return ea->tx < eb->tx ? -1 : 1;
+	}
+	if (ea->ty != eb->ty) {
+		return ea->ty < eb->ty ? -1 : 1;
+	}
+	return 0;
+}
+
+// A missing manifest is just an empty one
+int manifest_load(struct manifest *m, const char *path)
+{
+	m->entries = NULL;
+	m->len = 0;
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return 0;
+	}
+
+	size_t cap = 0;
+	struct manifest_entry entry;
+	while (fscanf(file, "%" SCNu32 " %" SCNu32 " %" SCNx64, &entry.tx, &entry.ty,
+				  &entry.hash) == 3) {
+		if (m->len == cap) {
+			cap = cap > 0 ? cap * 2 : 1024;
+			struct manifest_entry *entries = realloc(m->entries, cap * sizeof(entry));
+			if (entries == NULL) {
+				log_error("Failed to allocate memory for the manifest %s", path);
+				fclose(file);
+				manifest_free(m);
+				return -1;
+			}
+			m->entries = entries;
+		}
+		m->entries[m->len++] = entry;
+	}
+	fclose(file);
+
+	// Kept sorted on save, but the file might have been edited
+	qsort(m->entries, m->len, sizeof(m->entries[0]), entry_cmp);
+	return 0;
+}
+
+// Returns 0 for tiles not in the manifest
+uint64_t manifest_lookup(const struct manifest *m, uint32_t tx, uint32_t ty)
+{
+	if (m->len == 0) {
+		return 0;
+	}
+	struct manifest_entry key = { .tx = tx, .ty = ty };
+	struct manifest_entry *entry = bsearch(&key, m->entries, m->len,
+										   sizeof(m->entries[0]), entry_cmp);
+	return entry != NULL ? entry->hash : 0;
+}
+
+// Adds the entries of old for the tiles m does not cover, so that tiles
+// outside of the area of this run stay in the manifest, and drops the empty
+// tiles
+int manifest_merge(struct manifest *m, const struct manifest *old)
+{
+	qsort(m->entries, m->len, sizeof(m->entries[0]), entry_cmp);
+	size_t len = m->len;
+	struct manifest_entry *entries = realloc(m->entries,
+											 (m->len + old->len + 1) * sizeof(entries[0]));
+	if (entries == NULL) {
+		log_error("Failed to allocate memory for the manifest");
+		return -1;
+	}
+	m->entries = entries;
+	for (size_t i = 0; i < old->len; i++) {
+		if (bsearch(&old->entries[i], m->entries, len, sizeof(m->entries[0]),
+					entry_cmp) == NULL) {
+			m->entries[m->len++] = old->entries[i];
+		}
+	}
+
+	size_t kept = 0;
+	for (size_t i = 0; i < m->len; i++) {
+		if (m->entries[i].hash != 0) {
+			m->entries[kept++] = m->entries[i];
+		}
+	}
+	m->len = kept;
+	qsort(m->entries, m->len, sizeof(m->entries[0]), entry_cmp);
+	return 0;
+}
+
+int manifest_save(const struct manifest *m, const char *path)
+{
+	char tmppath[PATH_MAX];
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	FILE *file = fopen(tmppath, "w");
+	if (file == NULL) {
+		log_error_errno("Failed to save the manifest %s", path);
+		return -1;
+	}
+	for (size_t i = 0; i < m->len; i++) {
+		fprintf(file, "%" PRIu32 " %" PRIu32 " %016" PRIx64 "\n",
+				m->entries[i].tx, m->entries[i].ty, m->entries[i].hash);
+	}
+	if (fclose(file) != 0 || rename(tmppath, path) != 0) {
+		log_error_errno("Failed to save the manifest %s", path);
+		unlink(tmppath);
+		return -1;
+	}
+	return 0;
+}
+
+void manifest_free(struct manifest *m)
+{
+	free(m->entries);
+	m->entries = NULL;
+	m->len = 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hashes of the inputs of the rendered (meta)tiles of a zoomlevel, keyed by
+// the tile coordinates. A tile whose hash did not change since the last run
+// does not need to be rendered again. Hash 0 marks an empty tile.
+struct manifest_entry {
+	uint32_t tx;
+	uint32_t ty;
+	uint64_t hash;
+};
+
+struct manifest {
+	struct manifest_entry *entries;
+	size_t len;
+};
+
+int manifest_load(struct manifest *m, const char *path);
+uint64_t manifest_lookup(const struct manifest *m, uint32_t tx, uint32_t ty);
+int manifest_merge(struct manifest *m, const struct manifest *old);
+int manifest_save(const struct manifest *m, const char *path);
+void manifest_free(struct manifest *m);
+
+#endif
@@ -0,0 +1,677 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <bsd/string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "utils.h"
+
+#include "points.h"
+
+// Shorter than the shortest point record we can possibly see in the text
+// inputs, used for guessing the capacity of the point arrays up front
+#define TEXT_MIN_POINT_SIZE		16
+#define JSON_READ_SIZE			(1 << 16)
+#define JSON_MAX_TOKEN			128
+#define CSV_MAX_FIELDS			16
+#define BINARY_CHUNK			4096
+
+static inline size_t align8(size_t x)
+{
+	return (x + 7) & ~(size_t)7;
+}
+
+// Untouched pages of the over-estimate never get backed by memory, so
+// this does not cost anything and saves us from copying while growing
+static void points_reserve(struct points *points, size_t *cap, FILE *file)
+{
+	struct stat stat;
+	if (fstat(fileno(file), &stat) || !S_ISREG(stat.st_mode)) {
+		return;
+	}
+	*cap = stat.st_size / TEXT_MIN_POINT_SIZE + 1;
+	points->pts = malloc(*cap * sizeof(points->pts[0]));
+	points->vals = malloc(*cap * sizeof(points->vals[0]));
+	if (points->pts == NULL || points->vals == NULL) {
+		*cap = 0;
+	}
+}
+
+static bool points_push(struct points *points, size_t *cap, cl_float2 pt, float val)
+{
+	if (points->len >= *cap) {
+		*cap = *cap + *cap / 2 + 1;
+		cl_float2 *pts = realloc(points->pts, *cap * sizeof(points->pts[0]));
+		if (pts != NULL) {
+			points->pts = pts;
+		}
+		float *vals = realloc(points->vals, *cap * sizeof(points->vals[0]));
+		if (vals != NULL) {
+			points->vals = vals;
+		}
+		if (pts == NULL || vals == NULL) {
+			log_error("Failed to allocate memory for %zu points", *cap);
+			return false;
+		}
+	}
+	points->pts[points->len] = pt;
+	points->vals[points->len] = val;
+	points->len++;
+	return true;
+}
+
+// Gives the over-estimated memory back
+static void points_shrink(struct points *points, size_t cap)
+{
+	if (points->len == 0 || points->len >= cap) {
+		return;
+	}
+	cl_float2 *pts = realloc(points->pts, points->len * sizeof(points->pts[0]));
+	if (pts != NULL) {
+		points->pts = pts;
+	}
+	float *vals = realloc(points->vals, points->len * sizeof(points->vals[0]));
+	if (vals != NULL) {
+		points->vals = vals;
+	}
+}
+
+// A tiny pull parser for the {"points": [{"loc": [lat, lng], "val": v}, ...]}
+// input, so that we never have to hold the whole document in memory
+struct json_reader {
+	FILE *file;
+	char buf[JSON_READ_SIZE];
+	size_t pos;
+	size_t len;
+	size_t offset;
+};
+
+static int json_peek(struct json_reader *rd)
+{
+	if (rd->pos == rd->len) {
+		rd->offset += rd->len;
+		rd->len = fread(rd->buf, 1, sizeof(rd->buf), rd->file);
+		rd->pos = 0;
+		if (rd->len == 0) {
+			return EOF;
+		}
+	}
+	return (unsigned char)rd->buf[rd->pos];
+}
+
+static int json_next(struct json_reader *rd)
+{
+	int c = json_peek(rd);
+	if (c != EOF) {
+		rd->pos++;
+	}
+	return c;
+}
+
+static int json_skip_ws(struct json_reader *rd)
+{
+	int c;
+	while ((c = json_peek(rd)) != EOF && isspace(c)) {
+		rd->pos++;
+	}
+	return c;
+}
+
+static bool json_expect(struct json_reader *rd, char what)
+{
+	if (json_skip_ws(rd) != what) {
+		log_error("Malformed input JSON, expected '%c' at byte %zu", what,
+				  rd->offset + rd->pos);
+		return false;
+	}
+	rd->pos++;
+	return true;
+}
+
+// Reads a string into buf, truncating it if it does not fit
+static bool json_read_string(struct json_reader *rd, char *buf, size_t len)
+{
+	if (!json_expect(rd, '"')) {
+		return false;
+	}
+	size_t n = 0;
+	while (true) {
+		int c = json_next(rd);
+		if (c == EOF) {
+			log_error("Unterminated string in the input JSON");
+			return false;
+		}
+		if (c == '"') {
+			break;
+		}
+		if (c == '\\') {
+			c = json_next(rd);
+		}
+		if (n + 1 < len) {
+			buf[n++] = c;
+		}
+	}
+	if (len > 0) {
+		buf[n] = '\0';
+	}
+	return true;
+}
+
+// Numbers are accepted both bare and quoted
+static bool json_read_number(struct json_reader *rd, double *out)
+{
+	char tok[JSON_MAX_TOKEN];
+	int c = json_skip_ws(rd);
+	if (c == '"') {
+		if (!json_read_string(rd, tok, sizeof(tok))) {
+			return false;
+		}
+	} else {
+		size_t n = 0;
+		while ((c = json_peek(rd)) != EOF && strchr("+-.0123456789eE", c)) {
+			if (n + 1 < sizeof(tok)) {
+				tok[n++] = c;
+			}
+			rd->pos++;
+		}
+		tok[n] = '\0';
+	}
+	char *end;
+	*out = strtod(tok, &end);
+	if (end == tok || *end != '\0') {
+		log_error("Malformed number \"%s\" in the input JSON at byte %zu", tok,
+				  rd->offset + rd->pos);
+		return false;
+	}
+	return true;
+}
+
+static bool json_skip_value(struct json_reader *rd)
+{
+	unsigned int depth = 0;
+	do {
+		int c = json_skip_ws(rd);
+		switch (c) {
+			case EOF:
+				log_error("Unexpected end of the input JSON");
+				return false;
+			case '"':
+				if (!json_read_string(rd, NULL, 0)) {
+					return false;
+				}
+				break;
+			case '{':
+			case '[':
+				depth++;
+				rd->pos++;
+				break;
+			case '}':
+			case ']':
+				depth--;
+				rd->pos++;
+				break;
+			case ',':
+			case ':':
+				rd->pos++;
+				break;
+			default:
+				// Numbers and literals
+				while ((c = json_peek(rd)) != EOF && !isspace(c) &&
+						!strchr("{}[]\",:", c)) {
+					rd->pos++;
+				}
+				break;
+		}
+	} while (depth > 0);
+	return true;
+}
+
+// Calls fn for each member of an object, the reader positioned at its value
+static bool json_read_object(struct json_reader *rd,
+							 bool (*fn)(struct json_reader *, const char *, void *),
+							 void *arg)
+{
+	if (!json_expect(rd, '{')) {
+		return false;
+	}
+	if (json_skip_ws(rd) == '}') {
+		rd->pos++;
+		return true;
+	}
+	while (true) {
+		char key[JSON_MAX_TOKEN];
+		if (!json_read_string(rd, key, sizeof(key)) || !json_expect(rd, ':') ||
+				!fn(rd, key, arg)) {
+			return false;
+		}
+		int c = json_skip_ws(rd);
+		rd->pos++;
+		if (c == '}') {
+			return true;
+		}
+		if (c != ',') {
+			log_error("Malformed input JSON, expected ',' or '}' at byte %zu",
+					  rd->offset + rd->pos);
+			return false;
+		}
+	}
+}
+
+// And the same for each element of an array
+static bool json_read_array(struct json_reader *rd,
+							bool (*fn)(struct json_reader *, size_t, void *),
+							void *arg)
+{
+	if (!json_expect(rd, '[')) {
+		return false;
+	}
+	if (json_skip_ws(rd) == ']') {
+		rd->pos++;
+		return true;
+	}
+	for (size_t i = 0; ; i++) {
+		if (!fn(rd, i, arg)) {
+			return false;
+		}
+		int c = json_skip_ws(rd);
+		rd->pos++;
+		if (c == ']') {
+			return true;
+		}
+		if (c != ',') {
+			log_error("Malformed input JSON, expected ',' or ']' at byte %zu",
+					  rd->offset + rd->pos);
+			return false;
+		}
+	}
+}
+
+struct json_point_state {
+	struct points *points;
+	size_t cap;
+	bool found;
+	double loc[2];
+	double val;
+};
+
+static bool json_on_loc(struct json_reader *rd, size_t i, void *arg)
+{
+	struct json_point_state *st = arg;
+	if (i >= ARRAY_SIZE(st->loc)) {
+		return json_skip_value(rd);
+	}
+	return json_read_number(rd, &st->loc[i]);
+}
+
+static bool json_on_point_member(struct json_reader *rd, const char *key, void *arg)
+{
+	struct json_point_state *st = arg;
+	if (!strcmp(key, "loc")) {
+		return json_read_array(rd, json_on_loc, st);
+	} else if (!strcmp(key, "val")) {
+		return json_read_number(rd, &st->val);
+	}
+	return json_skip_value(rd);
+}
+
+static bool json_on_point(struct json_reader *rd, size_t i, void *arg)
+{
+	UNUSED(i);
+	struct json_point_state *st = arg;
+
+	st->loc[0] = st->loc[1] = st->val = 0.0;
+	if (!json_read_object(rd, json_on_point_member, st)) {
+		return false;
+	}
+
+	cl_float2 pt = { .x = st->loc[0], .y = st->loc[1] };
+	return points_push(st->points, &st->cap, pt, st->val);
+}
+
+static bool json_on_root_member(struct json_reader *rd, const char *key, void *arg)
+{
+	struct json_point_state *st = arg;
+	if (!strcmp(key, "points")) {
+		st->found = true;
+		return json_read_array(rd, json_on_point, st);
+	}
+	return json_skip_value(rd);
+}
+
+int points_load_json(const char *path, struct points *points)
+{
+	memset(points, 0, sizeof(*points));
+
+	struct json_reader *rd = calloc(1, sizeof(*rd));
+	if (rd == NULL) {
+		return -1;
+	}
+	rd->file = fopen(path, "rb");
+	if (rd->file == NULL) {
+		log_error_errno("Failed to open the input JSON file %s", path);
+		free(rd);
+		return -1;
+	}
+
+	struct json_point_state st = { .points = points, .cap = 0, .found = false };
+	points_reserve(points, &st.cap, rd->file);
+
+	bool ok = json_read_object(rd, json_on_root_member, &st);
+	fclose(rd->file);
+	free(rd);
+	if (ok && !st.found) {
+		log_error("Key \"points\" not found in the input file");
+		ok = false;
+	}
+	if (!ok) {
+		points_free(points);
+		return -1;
+	}
+
+	points_shrink(points, st.cap);
+
+	return 0;
+}
+
+// Splits a CSV line in place, handling quoted fields
+static size_t csv_split(char *line, char **fields, size_t maxfields)
+{
+	size_t n = 0;
+	char *out = line;
+	fields[n++] = out;
+	bool quoted = false;
+	for (char *in = line; *in != '\0' && *in != '\n' && *in != '\r'; in++) {
+		if (*in == '"') {
+			if (quoted && in[1] == '"') {
+				*out++ = *in++;
+			} else {
+				quoted = !quoted;
+			}
+		} else if (*in == ',' && !quoted) {
+			*out++ = '\0';
+			if (n == maxfields) {
+				return n;
+			}
+			fields[n++] = out;
+		} else {
+			*out++ = *in;
+		}
+	}
+	*out = '\0';
+	return n;
+}
+
+// Loads the Safecast measurements.csv export, only the measurements in CPM
+// are taken, same as examples/safecast/prepare-data.py does
+int points_load_csv(const char *path, struct points *points)
+{
+	memset(points, 0, sizeof(*points));
+
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		log_error_errno("Failed to open the input CSV file %s", path);
+		return -1;
+	}
+
+	size_t cap = 0;
+	points_reserve(points, &cap, file);
+
+	char *line = NULL;
+	size_t linecap = 0;
+	bool ok = true;
+	while (ok && getline(&line, &linecap, file) > 0) {
+		char *fields[CSV_MAX_FIELDS];
+		size_t nfields = csv_split(line, fields, ARRAY_SIZE(fields));
+		if (nfields < 5 || strcmp(fields[4], "cpm")) {
+			continue;
+		}
+		char *endlat, *endlng, *endval;
+		cl_float2 pt = {
+			.x = strtod(fields[1], &endlat),
+			.y = strtod(fields[2], &endlng),
+		};
+		float val = strtod(fields[3], &endval);
+		if (*endlat != '\0' || *endlng != '\0' || *endval != '\0' ||
+				endlat == fields[1] || endlng == fields[2] || endval == fields[3]) {
+			continue;
+		}
+		ok = points_push(points, &cap, pt, val);
+	}
+	free(line);
+	fclose(file);
+
+	if (!ok) {
+		points_free(points);
+		return -1;
+	}
+	points_shrink(points, cap);
+
+	return 0;
+}
+
+static bool points_is_mapped(struct points *points, void *ptr)
+{
+	return points->map != NULL && (uint8_t *)ptr >= (uint8_t *)points->map &&
+		(uint8_t *)ptr < (uint8_t *)points->map + points->maplen;
+}
+
+static bool header_column_ok(struct points_header *hdr, uint64_t off, size_t elsize,
+							 size_t filelen)
+{
+	return off % 8 == 0 && off >= sizeof(*hdr) && off <= filelen &&
+		hdr->len <= (filelen - off) / elsize;
+}
+
+// The pre-projected column is only used if it matches projdef, otherwise
+// the caller gets the WGS84 coordinates to project itself
+int points_load_binary(const char *path, const char *projdef, struct points *points)
+{
+	memset(points, 0, sizeof(*points));
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		log_error_errno("Failed to open the input file %s", path);
+		return -1;
+	}
+	struct stat stat;
+	if (fstat(fd, &stat)) {
+		log_error_errno("Failed to stat the input file %s", path);
+		close(fd);
+		return -1;
+	}
+	size_t filelen = stat.st_size;
+	if (filelen < sizeof(struct points_header)) {
+		log_error("The input file %s is too short", path);
+		close(fd);
+		return -1;
+	}
+	// Private, as the grid reorders the points in place
+	void *map = mmap(NULL, filelen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_error_errno("Failed to mmap the input file %s", path);
+		return -1;
+	}
+	points->map = map;
+	points->maplen = filelen;
+
+	struct points_header *hdr = map;
+	if (memcmp(hdr->magic, POINTS_MAGIC, sizeof(hdr->magic)) ||
+			hdr->version != POINTS_VERSION) {
+		log_error("The input file %s is not a supported point file", path);
+		points_free(points);
+		return -1;
+	}
+	hdr->proj[sizeof(hdr->proj) - 1] = '\0';
+	if (!header_column_ok(hdr, hdr->off_lat, sizeof(float), filelen) ||
+			!header_column_ok(hdr, hdr->off_lng, sizeof(float), filelen) ||
+			!header_column_ok(hdr, hdr->off_val, sizeof(float), filelen) ||
+			(hdr->off_xy != 0 &&
+			 !header_column_ok(hdr, hdr->off_xy, sizeof(cl_float2), filelen))) {
+		log_error("The point file %s is truncated or corrupted", path);
+		points_free(points);
+		return -1;
+	}
+
+	points->len = hdr->len;
+	points->srcsize = hdr->srcsize;
+	points->srcmtime = hdr->srcmtime;
+	points->vals = (float *)((uint8_t *)map + hdr->off_val);
+	if (hdr->off_xy != 0 && projdef != NULL && !strcmp(hdr->proj, projdef)) {
+		points->pts = (cl_float2 *)((uint8_t *)map + hdr->off_xy);
+		points->projected = true;
+		return 0;
+	}
+
+	float *lat = (float *)((uint8_t *)map + hdr->off_lat);
+	float *lng = (float *)((uint8_t *)map + hdr->off_lng);
+	points->pts = malloc(max(points->len, (size_t)1) * sizeof(points->pts[0]));
+	if (points->pts == NULL) {
+		log_error("Failed to allocate memory for %zu points", points->len);
+		points_free(points);
+		return -1;
+	}
+	for (size_t i = 0; i < points->len; i++) {
+		points->pts[i].x = lat[i];
+		points->pts[i].y = lng[i];
+	}
+
+	return 0;
+}
+
+// Writes one component of an array of elsize-d elements as a column
+static bool write_column(FILE *file, const void *base, size_t elsize, size_t len)
+{
+	float buf[BINARY_CHUNK];
+	for (size_t i = 0; i < len; i += ARRAY_SIZE(buf)) {
+		size_t n = min(len - i, ARRAY_SIZE(buf));
+		for (size_t j = 0; j < n; j++) {
+			buf[j] = *(const float *)((const uint8_t *)base + (i + j) * elsize);
+		}
+		if (fwrite(buf, sizeof(buf[0]), n, file) != n) {
+			return false;
+		}
+	}
+	static const uint8_t zeros[8];
+	size_t pad = align8(len * sizeof(float)) - len * sizeof(float);
+	return fwrite(zeros, 1, pad, file) == pad;
+}
+
+int points_save_binary(const char *path, struct points *points, cl_float2 *projected,
+					   const char *projdef, const struct stat *src)
+{
+	struct points_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, POINTS_MAGIC, sizeof(hdr.magic));
+	hdr.version = POINTS_VERSION;
+	hdr.len = points->len;
+	if (src != NULL) {
+		hdr.srcsize = src->st_size;
+		hdr.srcmtime = stat_mtime_ns(src);
+	}
+	size_t colsize = align8(points->len * sizeof(float));
+	hdr.off_lat = align8(sizeof(hdr));
+	hdr.off_lng = hdr.off_lat + colsize;
+	hdr.off_val = hdr.off_lng + colsize;
+	if (projected != NULL) {
+		if (strlcpy(hdr.proj, projdef, sizeof(hdr.proj)) >= sizeof(hdr.proj)) {
+			log_error("Projection definition \"%s\" is too long", projdef);
+			return -1;
+		}
+		hdr.off_xy = hdr.off_val + colsize;
+	}
+
+	// Write to a temporary file first, so readers never see a partial one
+	char tmppath[PATH_MAX];
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	FILE *file = fopen(tmppath, "wb");
+	if (file == NULL) {
+		log_error_errno("Failed to open %s for writing", tmppath);
+		return -1;
+	}
+	static const uint8_t zeros[8];
+	size_t hdrpad = hdr.off_lat - sizeof(hdr);
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, file) == 1 &&
+		fwrite(zeros, 1, hdrpad, file) == hdrpad &&
+		write_column(file, &points->pts[0].x, sizeof(points->pts[0]), points->len) &&
+		write_column(file, &points->pts[0].y, sizeof(points->pts[0]), points->len) &&
+		write_column(file, points->vals, sizeof(points->vals[0]), points->len) &&
+		(projected == NULL ||
+		 fwrite(projected, sizeof(projected[0]), points->len, file) == points->len);
+	if (fclose(file) || !ok) {
+		log_error_errno("Failed to write %s", tmppath);
+		unlink(tmppath);
+		return -1;
+	}
+	if (rename(tmppath, path)) {
+		log_error_errno("Failed to rename %s to %s", tmppath, path);
+		unlink(tmppath);
+		return -1;
+	}
+
+	return 0;
+}
+
+int points_load(const char *path, const char *projdef, struct points *points)
+{
+	char magic[4] = { 0 };
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		log_error_errno("Failed to open the input file %s", path);
+		return -1;
+	}
+	size_t n = fread(magic, 1, sizeof(magic), file);
+	fclose(file);
+
+	if (n == sizeof(magic) && !memcmp(magic, POINTS_MAGIC, sizeof(magic))) {
+		return points_load_binary(path, projdef, points);
+	} else if (strends(path, ".csv")) {
+		return points_load_csv(path, points);
+	}
+	return points_load_json(path, points);
+}
+
+void points_free(struct points *points)
+{
+	if (!points_is_mapped(points, points->pts)) {
+		free(points->pts);
+	}
+	if (!points_is_mapped(points, points->vals)) {
+		free(points->vals);
+	}
+	if (points->map != NULL) {
+		munmap(points->map, points->maplen);
+	}
+	memset(points, 0, sizeof(*points));
+}
@@ -0,0 +1,79 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#ifndef POINTS_H
+#define POINTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <CL/cl.h>
+
+// Input points, with the WGS84 coordinates stored as (lat, lng) until they
+// get projected
+struct points {
+	size_t len;
+	cl_float2 *pts;
+	float *vals;
+	// The points are already in the requested projection
+	bool projected;
+	// Binary point files are mapped instead of read
+	void *map;
+	size_t maplen;
+	// Size and modification time of the file a binary file was converted from
+	uint64_t srcsize;
+	int64_t srcmtime;
+};
+
+// Binary point files start with this header, followed by the columns at the
+// given offsets. The lat, lng and val columns are floats, the optional
+// projected column is an interleaved array of (x, y) pairs.
+#define POINTS_MAGIC		"CLHM"
+#define POINTS_VERSION		1
+#define POINTS_PROJ_MAX		256
+
+struct points_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t len;
+	// Size and modification time of the file the points were converted from
+	uint64_t srcsize;
+	int64_t srcmtime;
+	uint64_t off_lat;
+	uint64_t off_lng;
+	uint64_t off_val;
+	uint64_t off_xy; // Zero if there is no projected column
+	char proj[POINTS_PROJ_MAX]; // Definition of the projected column
+};
+
+int points_load(const char *path, const char *projdef, struct points *points);
+int points_load_json(const char *path, struct points *points);
+int points_load_csv(const char *path, struct points *points);
+int points_load_binary(const char *path, const char *projdef, struct points *points);
+int points_save_binary(const char *path, struct points *points, cl_float2 *projected,
+					   const char *projdef, const struct stat *src);
+void points_free(struct points *points);
+
+#endif
@@ -121,21 +121,6 @@ static cl_float2 transform_proj(cl_float2 in, int zoom, projPJ proj)
 	return wgs84_to_meters(tile_to_wgs84(in, zoom), proj);
 }
 
-static cl_float2 transform_linear(cl_float2 in, cl_float4 *tr)
-{
-	cl_float2 out;
-
-	out.x = in.x * tr[0].x + in.y * tr[0].y + tr[0].z;
-	out.y = in.x * tr[1].x + in.y * tr[1].y + tr[1].z;
-
-	return out;
-}
-
-float randf()
-{
-	return (float)rand() / RAND_MAX;
-}
-
 static cl_float2 calculate_avg_and_dev(float *ft, size_t len)
 {
 	float avg = 0.0;
@@ -167,9 +152,6 @@ int main(int argc, char *argv[])
 
 	init_projs();
 
-	// We want the benchmark to be deterministic
-	srand(2);
-
 	if (args.proj_meters == NULL) {
 		args.proj_meters = pj_init_plus("+init=epsg:3045");
 	}
@@ -178,8 +160,13 @@ int main(int argc, char *argv[])
 	size_t total_npts = total_ntiles * N_PTS;
 	float xlens[total_ntiles];
 	float ylens[total_ntiles];
+	cl_float2 *errs = calloc(total_npts, sizeof(cl_float2));
 	float *xerrs = calloc(total_npts, sizeof(float));
 	float *yerrs = calloc(total_npts, sizeof(float));
+	static const char *order_names[] = {
+		[TRANSFORM_AFFINE] = "affine",
+		[TRANSFORM_QUADRATIC] = "quadratic",
+	};
 
 	for (int zoom = args.zmin; zoom <= args.zmax; zoom++) {
 		printf("zoom = %d:\n", zoom);
@@ -190,7 +177,6 @@ int main(int argc, char *argv[])
 			.y = floor(tilecenter.y - RECT_SIDE / 2),
 		};
 		size_t ntiles = 0;
-		size_t npts = 0;
 		for (unsigned int x = 0; x < RECT_SIDE; x++) {
 			for (unsigned int y = 0; y < RECT_SIDE; y++, ntiles++) {
 				// Calculate side lengths
@@ -204,41 +190,52 @@ int main(int argc, char *argv[])
 						zoom, args.proj_meters);
 				xlens[ntiles] = fabs(metlt.x - metrb.x);
 				ylens[ntiles] = fabs(metlt.y - metrb.y);
-
-				// Calculate transformation matrix
-				cl_float4 trmat[2];
-				generate_translation_tile(tx, ty, zoom, trmat, args.proj_meters);
-
-				// Sample a bunch of random points
-				for (int i = 0; i < N_PTS; i++, npts++) {
-					cl_float2 pt = { .x = randf(), .y = randf() };
-					cl_float2 ptf = { .x = tx + pt.x, .y = ty + pt.y };
-					cl_float2 ptp = transform_proj(ptf, zoom, args.proj_meters);
-					cl_float2 ptl = transform_linear(pt, trmat);
-
-					xerrs[npts] = fabs(ptp.x - ptl.x);
-					yerrs[npts] = fabs(ptp.y - ptl.y);
-				}
 			}
 		}
-		if (ntiles != total_ntiles || npts != total_npts) {
-			printf("WTF?!");
-		}
 
 		printf(" avg pixel size:\n");
 		cl_float2 res = calculate_avg_and_dev(xlens, ntiles);
 		printf("  x = %.2fm (+- %.3f) \n", res.x / TILE_SIZE, res.y / TILE_SIZE);
 		res = calculate_avg_and_dev(ylens, ntiles);
 		printf("  y = %.2fm (+- %.3f) \n", res.x / TILE_SIZE, res.y / TILE_SIZE);
-		printf(" avg errors:\n");
-		res = calculate_avg_and_dev(xerrs, npts);
-		printf("  x = %.2fm (+- %.3f)\n", res.x, res.y);
-		res = calculate_avg_and_dev(yerrs, npts);
-		printf("  y = %.2fm (+- %.3f)\n", res.x, res.y);
+
+		for (int order = TRANSFORM_AFFINE; order <= TRANSFORM_QUADRATIC; order++) {
+			// We want the benchmark to be deterministic, and both orders to
+			// see the same points
+			unsigned int seed = 2;
+			size_t npts = 0;
+			float maxerr = 0.0;
+			for (unsigned int x = 0; x < RECT_SIDE; x++) {
+				for (unsigned int y = 0; y < RECT_SIDE; y++, npts += N_PTS) {
+					float side;
+					if (sample_transform_errors(ltcorner.x + x, ltcorner.y + y, zoom, order,
+												N_PTS, &seed, &errs[npts], &side,
+												args.proj_meters)) {
+						return 1;
+					}
+				}
+			}
+			if (npts != total_npts) {
+				printf("WTF?!");
+			}
+			for (size_t i = 0; i < npts; i++) {
+				xerrs[i] = errs[i].x;
+				yerrs[i] = errs[i].y;
+				maxerr = max(maxerr, hypotf(errs[i].x, errs[i].y));
+			}
+
+			printf(" avg errors (%s):\n", order_names[order]);
+			res = calculate_avg_and_dev(xerrs, npts);
+			printf("  x = %.2fm (+- %.3f)\n", res.x, res.y);
+			res = calculate_avg_and_dev(yerrs, npts);
+			printf("  y = %.2fm (+- %.3f)\n", res.x, res.y);
+			printf("  max = %.2fm\n", maxerr);
+		}
 	}
 
 	pj_free(args.proj_meters);
 
+	free(errs);
 	free(xerrs);
 	free(yerrs);
 }
@@ -0,0 +1,256 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coords.h"
+#include "utils.h"
+
+#include "projection.h"
+
+// Parameters which only describe the ellipsoid, which comes from
+// pj_get_spheroid_defn, or do not change the projection at all
+static const char *ignored_params[] = {
+	"init", "ellps", "a", "b", "rf", "f", "es", "e", "R", "no_defs", "wktext", "type",
+};
+
+// The numeric parameters of the definition the kernels understand
+struct proj_params {
+	const char *proj;
+	double lat0;
+	double lon0;
+	double k0;
+	double x0;
+	double y0;
+	double latts;
+	long zone;
+	bool south;
+	bool has_k0;
+	bool has_latts;
+};
+
+static bool parse_number(const char *val, double *out)
+{
+	char *end;
+	if (val == NULL) {
+		return false;
+	}
+	*out = strtod(val, &end);
+	return end != val && *end == '\0';
+}
+
+// A datum shift which does not shift anything, like towgs84=0,0,0
+static bool zero_list(const char *val)
+{
+	const char *p = val;
+	while (p != NULL) {
+		char *end;
+		if (strtod(p, &end) != 0.0 || end == p || (*end != ',' && *end != '\0')) {
+			return false;
+		}
+		p = *end == ',' ? end + 1 : NULL;
+	}
+	return true;
+}
+
+static bool parse_param(struct proj_params *pp, char *key, char *val)
+{
+	double num;
+	if (!strcmp(key, "proj")) {
+		pp->proj = val;
+	} else if (!strcmp(key, "lat_0")) {
+		return parse_number(val, &pp->lat0);
+	} else if (!strcmp(key, "lon_0")) {
+		return parse_number(val, &pp->lon0);
+	} else if (!strcmp(key, "k_0") || !strcmp(key, "k")) {
+		pp->has_k0 = true;
+		return parse_number(val, &pp->k0);
+	} else if (!strcmp(key, "x_0")) {
+		return parse_number(val, &pp->x0);
+	} else if (!strcmp(key, "y_0")) {
+		return parse_number(val, &pp->y0);
+	} else if (!strcmp(key, "lat_ts")) {
+		pp->has_latts = true;
+		return parse_number(val, &pp->latts);
+	} else if (!strcmp(key, "zone")) {
+		if (!parse_number(val, &num) || num < 1 || num > 60 || num != floor(num)) {
+			return false;
+		}
+		pp->zone = num;
+	} else if (!strcmp(key, "south")) {
+		pp->south = true;
+	} else if (!strcmp(key, "units")) {
+		return val != NULL && !strcmp(val, "m");
+	} else if (!strcmp(key, "to_meter")) {
+		return parse_number(val, &num) && num == 1.0;
+	} else if (!strcmp(key, "towgs84")) {
+		return val != NULL && zero_list(val);
+	} else if (!strcmp(key, "nadgrids")) {
+		return val != NULL && !strcmp(val, "@null");
+	} else if (!strcmp(key, "datum")) {
+		return val != NULL && !strcmp(val, "WGS84");
+	} else if (!strcmp(key, "axis")) {
+		return val != NULL && !strcmp(val, "enu");
+	} else if (!strcmp(key, "pm")) {
+		return val != NULL && (!strcmp(val, "greenwich") || (parse_number(val, &num) && num == 0.0));
+	} else {
+		for (size_t i = 0; i < ARRAY_SIZE(ignored_params); i++) {
+			if (!strcmp(key, ignored_params[i])) {
+				return true;
+			}
+		}
+		return false;
+	}
+	return true;
+}
+
+// Projected coordinates from the isometric latitude of the sphere and the
+// longitude from the central meridian. Same as in kernels/projection.h, in
+// doubles all the way.
+static void project_isometric(const struct kernel_projection *kp, double psi, double lam,
+							  double *outx, double *outy)
+{
+	lam = remainder(lam, 2.0 * M_PI);
+	// Isometric latitude of the ellipsoid
+	double q = psi - kp->e * atanh(kp->e * tanh(psi));
+	double x = lam;
+	double y = q;
+	if (kp->type == KERNEL_PROJECTION_TMERC) {
+		// The Krueger series, see Karney (2011), Transverse Mercator with an
+		// accuracy of a few nanometers
+		double t = sinh(q);
+		double xi = atan2(t, cos(lam));
+		double eta = atanh(sin(lam) / sqrt(1.0 + t * t));
+		x = eta;
+		y = xi;
+		for (int j = 0; j < KERNEL_PROJECTION_TERMS; j++) {
+			y += kp->alpha[j] * sin(2.0 * (j + 1) * xi) * cosh(2.0 * (j + 1) * eta);
+			x += kp->alpha[j] * cos(2.0 * (j + 1) * xi) * sinh(2.0 * (j + 1) * eta);
+		}
+	}
+	*outx = kp->x0 + kp->ka * x;
+	*outy = kp->y0 + kp->ka * y;
+}
+
+// Checks whether the kernels can do the projection themselves, returns -1
+// if they cannot
+int kernel_projection_init(struct kernel_projection *kp, projPJ proj)
+{
+	memset(kp, 0, sizeof(*kp));
+	struct proj_params pp = {
+		.proj = NULL,
+		.k0 = 1.0,
+	};
+	char *def = proj_definition(proj);
+	bool supported = def != NULL;
+	char *save;
+	for (char *tok = supported ? strtok_r(def, " ", &save) : NULL; tok != NULL && supported;
+			tok = strtok_r(NULL, " ", &save)) {
+		if (*tok++ != '+') {
+			supported = false;
+			break;
+		}
+		char *val = strchr(tok, '=');
+		if (val != NULL) {
+			*val++ = '\0';
+		}
+		supported = parse_param(&pp, tok, val);
+	}
+	if (supported && pp.proj != NULL) {
+		if (!strcmp(pp.proj, "tmerc") || !strcmp(pp.proj, "etmerc")) {
+			kp->type = KERNEL_PROJECTION_TMERC;
+		} else if (!strcmp(pp.proj, "utm") && pp.zone != 0) {
+			kp->type = KERNEL_PROJECTION_TMERC;
+			pp.lat0 = 0.0;
+			pp.lon0 = (pp.zone - 1) * 6.0 - 180.0 + 3.0;
+			pp.k0 = 0.9996;
+			pp.x0 = 500000.0;
+			pp.y0 = pp.south ? 10000000.0 : 0.0;
+		} else if (!strcmp(pp.proj, "merc")) {
+			kp->type = KERNEL_PROJECTION_MERC;
+		}
+	}
+	free(def);
+	if (kp->type == KERNEL_PROJECTION_NONE) {
+		return -1;
+	}
+
+	double a, es;
+	pj_get_spheroid_defn(proj, &a, &es);
+	kp->e = sqrt(es);
+	kp->lon0 = pp.lon0 * DEG_TO_RAD;
+	kp->x0 = pp.x0;
+	kp->y0 = 0.0;
+	if (kp->type == KERNEL_PROJECTION_MERC) {
+		if (!pp.has_k0 && pp.has_latts) {
+			double sints = sin(pp.latts * DEG_TO_RAD);
+			pp.k0 = cos(pp.latts * DEG_TO_RAD) / sqrt(1.0 - es * sints * sints);
+		}
+		kp->ka = pp.k0 * a;
+		kp->y0 = pp.y0;
+		return 0;
+	}
+
+	double f = 1.0 - sqrt(1.0 - es);
+	double n = f / (2.0 - f);
+	double n2 = n * n;
+	double n3 = n2 * n;
+	double n4 = n3 * n;
+	double n5 = n4 * n;
+	double n6 = n5 * n;
+	kp->ka = pp.k0 * a / (1.0 + n) * (1.0 + n2 / 4.0 + n4 / 64.0 + n6 / 256.0);
+	kp->alpha[0] = n / 2.0 - 2.0 * n2 / 3.0 + 5.0 * n3 / 16.0 + 41.0 * n4 / 180.0 -
+		127.0 * n5 / 288.0 + 7891.0 * n6 / 37800.0;
+	kp->alpha[1] = 13.0 * n2 / 48.0 - 3.0 * n3 / 5.0 + 557.0 * n4 / 1440.0 +
+		281.0 * n5 / 630.0 - 1983433.0 * n6 / 1935360.0;
+	kp->alpha[2] = 61.0 * n3 / 240.0 - 103.0 * n4 / 140.0 + 15061.0 * n5 / 26880.0 +
+		167603.0 * n6 / 181440.0;
+	kp->alpha[3] = 49561.0 * n4 / 161280.0 - 179.0 * n5 / 168.0 + 6601661.0 * n6 / 7257600.0;
+	kp->alpha[4] = 34729.0 * n5 / 80640.0 - 3418889.0 * n6 / 1995840.0;
+	kp->alpha[5] = 212378941.0 * n6 / 319334400.0;
+	// The northing is relative to lat_0
+	double x, y;
+	project_isometric(kp, atanh(sin(pp.lat0 * DEG_TO_RAD)), 0.0, &x, &y);
+	kp->y0 = pp.y0 - y;
+	return 0;
+}
+
+// Appends the definitions which compile the projection into the kernels
+int kernel_projection_args(const struct kernel_projection *kp, char *buf, size_t len)
+{
+	size_t used = strlen(buf);
+	used += snprintf(buf + used, len - min(used, len),
+					 " -DPROJECTION=%d -DPROJ_E=%.17g -DPROJ_KA=%.17g -DPROJ_LON0=%.17g"
+					 " -DPROJ_X0=%.17g -DPROJ_Y0=%.17g",
+					 kp->type, kp->e, kp->ka, kp->lon0, kp->x0, kp->y0);
+	for (int j = 0; j < KERNEL_PROJECTION_TERMS && kp->type == KERNEL_PROJECTION_TMERC; j++) {
+		used += snprintf(buf + used, len - min(used, len), " -DPROJ_ALPHA%d=%.17g",
+						 j + 1, kp->alpha[j]);
+	}
+	return used < len ? 0 : -1;
+}
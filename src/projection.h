@@ -0,0 +1,62 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#ifndef PROJECTION_H
+#define PROJECTION_H
+
+#include <stddef.h>
+#include <proj_api.h>
+#include <CL/cl.h>
+
+// Same as in kernels/projection.h
+enum kernel_projection_type {
+	KERNEL_PROJECTION_NONE = 0,
+	KERNEL_PROJECTION_TMERC = 1,
+	KERNEL_PROJECTION_MERC = 2,
+};
+
+#define KERNEL_PROJECTION_TERMS 6
+
+// Projections the kernels can evaluate exactly on their own, from the WGS84
+// points and the tile coordinates. Anything else goes through proj4 on the
+// host and the fitted tile transforms.
+struct kernel_projection {
+	enum kernel_projection_type type;
+	// Eccentricity of the ellipsoid
+	double e;
+	// Scale times the rectifying radius for tmerc, the major axis for merc
+	double ka;
+	// Coefficients of the Krueger series of tmerc
+	double alpha[KERNEL_PROJECTION_TERMS];
+	// Central meridian in radians
+	double lon0;
+	double x0;
+	// Includes the northing of lat_0 for tmerc
+	double y0;
+};
+
+int kernel_projection_init(struct kernel_projection *kp, projPJ proj);
+int kernel_projection_args(const struct kernel_projection *kp, char *buf, size_t len);
+
+#endif
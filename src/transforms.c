@@ -0,0 +1,226 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <bsd/string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "utils.h"
+
+#include "transforms.h"
+
+#define TRANSFORMS_MAGIC "CLHMTRF3"
+// Past this, a file which does not cover the tiles is replaced instead of
+// grown to cover both the old and the new ones
+#define TRANSFORMS_MAX_TILES (1u << 24)
+
+// Padded so that the transforms after it stay aligned
+struct transform_header {
+	char magic[8];
+	uint64_t projhash;
+	int32_t zoom;
+	int32_t order;
+	uint32_t left;
+	uint32_t top;
+	uint32_t width;
+	uint32_t height;
+	uint8_t reserved[24];
+};
+
+static size_t store_size(uint32_t width, uint32_t height)
+{
+	return sizeof(struct transform_header) + (size_t)width * height * 2 * sizeof(cl_float8);
+}
+
+static bool store_covers(const struct transform_header *hdr, unsigned int left,
+						 unsigned int top, unsigned int right, unsigned int bot)
+{
+	return left >= hdr->left && top >= hdr->top &&
+		right <= hdr->left + hdr->width && bot <= hdr->top + hdr->height;
+}
+
+static int store_map(struct transform_store *ts, int fd, const struct transform_header *hdr)
+{
+	ts->maplen = store_size(hdr->width, hdr->height);
+	ts->map = mmap(NULL, ts->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ts->map == MAP_FAILED) {
+		ts->map = NULL;
+		return -1;
+	}
+	ts->zoom = hdr->zoom;
+	ts->order = hdr->order;
+	ts->left = hdr->left;
+	ts->top = hdr->top;
+	ts->width = hdr->width;
+	ts->height = hdr->height;
+	ts->entries = (cl_float8 *)((char *)ts->map + sizeof(*hdr));
+	return 0;
+}
+
+// Creates a new file covering the rectangle, with the transforms of the old
+// one (if any) copied over, and maps it
+static int store_create(struct transform_store *ts, const char *path,
+						const struct transform_header *hdr,
+						const struct transform_store *old)
+{
+	char tmppath[PATH_MAX];
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	int fd = open(tmppath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log_error_errno("Failed to create the transform cache %s", tmppath);
+		return -1;
+	}
+	// The transforms start zeroed, without taking any space until written
+	if (ftruncate(fd, store_size(hdr->width, hdr->height)) ||
+			pwrite(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+			store_map(ts, fd, hdr)) {
+		log_error_errno("Failed to create the transform cache %s", tmppath);
+		close(fd);
+		unlink(tmppath);
+		return -1;
+	}
+	close(fd);
+
+	if (old != NULL) {
+		unsigned int left = max(old->left, ts->left);
+		unsigned int right = min(old->left + old->width, ts->left + ts->width);
+		unsigned int top = max(old->top, ts->top);
+		unsigned int bot = min(old->top + old->height, ts->top + ts->height);
+		for (unsigned int y = top; y < bot && left < right; y++) {
+			memcpy(&ts->entries[((size_t)(y - ts->top) * ts->width + left - ts->left) * 2],
+				   &old->entries[((size_t)(y - old->top) * old->width + left - old->left) * 2],
+				   (right - left) * 2 * sizeof(cl_float8));
+		}
+	}
+
+	if (rename(tmppath, path)) {
+		log_error_errno("Failed to save the transform cache %s", path);
+		transform_store_close(ts);
+		unlink(tmppath);
+		return -1;
+	}
+	return 0;
+}
+
+// Opens the store of the zoomlevel and transform order, making sure it
+// covers the tiles from left, top up to right, bot (exclusive). The file is
+// keyed by the proj4 definition, so other projections never pick up its
+// transforms.
+int transform_store_open(struct transform_store *ts, const char *cachedir,
+						 const char *projdef, int zoom, int order, unsigned int left,
+						 unsigned int top, unsigned int right, unsigned int bot)
+{
+	uint64_t projhash = hash_str(HASH_INIT, projdef);
+	char dirpath[PATH_MAX];
+	snprintf(dirpath, sizeof(dirpath), "%s/transforms/%016" PRIx64, cachedir, projhash);
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%d.o%d.bin", dirpath, zoom, order);
+
+	memset(ts, 0, sizeof(*ts));
+	char mkpath[PATH_MAX];
+	strlcpy(mkpath, dirpath, sizeof(mkpath));
+	if (mkdir_recursive(mkpath, S_IRWXU)) {
+		log_error_errno("Failed to create %s", dirpath);
+		return -1;
+	}
+
+	struct transform_header hdr;
+	struct stat st;
+	int fd = open(path, O_RDWR);
+	bool valid = fd >= 0 && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+		!memcmp(hdr.magic, TRANSFORMS_MAGIC, sizeof(hdr.magic)) &&
+		hdr.projhash == projhash && hdr.zoom == zoom && hdr.order == order &&
+		fstat(fd, &st) == 0 && (size_t)st.st_size == store_size(hdr.width, hdr.height);
+
+	if (valid && store_covers(&hdr, left, top, right, bot)) {
+		int ret = store_map(ts, fd, &hdr);
+		if (ret) {
+			log_error_errno("Failed to map the transform cache %s", path);
+		}
+		close(fd);
+		return ret;
+	}
+
+	struct transform_store old = { 0 };
+	struct transform_header newhdr = {
+		.projhash = projhash,
+		.zoom = zoom,
+		.order = order,
+		.left = left,
+		.top = top,
+		.width = right - left,
+		.height = bot - top,
+	};
+	memcpy(newhdr.magic, TRANSFORMS_MAGIC, sizeof(newhdr.magic));
+	if (valid) {
+		// Grow it to cover both, unless they are too far apart
+		uint32_t uleft = min(hdr.left, left);
+		uint32_t utop = min(hdr.top, top);
+		uint32_t uwidth = max(hdr.left + hdr.width, right) - uleft;
+		uint32_t uheight = max(hdr.top + hdr.height, bot) - utop;
+		if ((uint64_t)uwidth * uheight <= TRANSFORMS_MAX_TILES &&
+				store_map(&old, fd, &hdr) == 0) {
+			newhdr.left = uleft;
+			newhdr.top = utop;
+			newhdr.width = uwidth;
+			newhdr.height = uheight;
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	int ret = store_create(ts, path, &newhdr, old.map != NULL ? &old : NULL);
+	transform_store_close(&old);
+	return ret;
+}
+
+// Returns the two transform vectors of the tile, NULL for tiles outside of
+// the store
+cl_float8 *transform_store_get(struct transform_store *ts, unsigned int x, unsigned int y)
+{
+	if (x < ts->left || y < ts->top || x - ts->left >= ts->width ||
+			y - ts->top >= ts->height) {
+		return NULL;
+	}
+	return &ts->entries[((size_t)(y - ts->top) * ts->width + x - ts->left) * 2];
+}
+
+void transform_store_close(struct transform_store *ts)
+{
+	if (ts->map != NULL) {
+		munmap(ts->map, ts->maplen);
+	}
+	ts->map = NULL;
+	ts->entries = NULL;
+}
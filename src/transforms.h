@@ -0,0 +1,55 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#ifndef TRANSFORMS_H
+#define TRANSFORMS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <CL/cl.h>
+
+// Cache of the tile transforms of a single zoomlevel, order and projection. The
+// transforms are kept in a dense array over a rectangle of tiles, in a file
+// mapped into memory, so a warm run does not have to open a file per tile.
+// The file grows to cover the tiles of later runs as needed.
+struct transform_store {
+	int zoom;
+	int order;
+	unsigned int left;
+	unsigned int top;
+	unsigned int width;
+	unsigned int height;
+	// Two cl_float8 per tile, zero until the transform gets computed
+	cl_float8 *entries;
+	void *map;
+	size_t maplen;
+};
+
+int transform_store_open(struct transform_store *ts, const char *cachedir,
+						 const char *projdef, int zoom, int order, unsigned int left,
+						 unsigned int top, unsigned int right, unsigned int bot);
+cl_float8 *transform_store_get(struct transform_store *ts, unsigned int x, unsigned int y);
+void transform_store_close(struct transform_store *ts);
+
+#endif
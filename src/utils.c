@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <bsd/string.h>
 #include <string.h>
+#include <time.h>
 
 #include "utils.h"
 
@@ -65,6 +66,9 @@ int mkdir_recursive(char *path, mode_t mode)
 	char *save;
 	char dir[PATH_MAX];
 	bzero(dir, sizeof(dir));
+	if (path[0] == '/') {
+		dir[0] = '/';
+	}
 	while (true) {
 		char *tok = strtok_r(path, "/", &save);
 		path = NULL;
@@ -74,7 +78,7 @@ int mkdir_recursive(char *path, mode_t mode)
 		strlcat(dir, tok, sizeof(dir));
 		strlcat(dir, "/", sizeof(dir));
 		int ret = mkdir(dir, mode);
-		if (ret <= 0 && errno != EEXIST) {
+		if (ret < 0 && errno != EEXIST) {
 			perror("Failed to mkdir!");
 			return ret;
 		}
@@ -94,3 +98,10 @@ bool strends(const char *str, const char *suffix)
 
 	return strcmp(&str[strl - suffl], suffix) == 0;
 }
+
+double time_monotonic()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -26,6 +26,8 @@
 #define UTILS_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <stdbool.h>
 
@@ -39,6 +41,8 @@
 	__typeof__(b) _b = (b); \
 	_a < _b ? _a : _b; })
 
+#define clamp(x, lo, hi) min(max((x), (lo)), (hi))
+
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
 #define UNUSED(x) ((void)(x))
@@ -48,8 +52,33 @@
 	__typeof__(t) _t = (t); \
 	((long)(_x / _t)) * _t;})
 
+// FNV-1a, used for naming cache files
+#define HASH_INIT 0xcbf29ce484222325ull
+
+static inline uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *bytes = data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+static inline uint64_t hash_str(uint64_t hash, const char *str)
+{
+	// Including the terminator, so that ("ab", "c") and ("a", "bc") differ
+	return hash_bytes(hash, str, strlen(str) + 1);
+}
+
+static inline int64_t stat_mtime_ns(const struct stat *st)
+{
+	return st->st_mtim.tv_sec * 1000000000ll + st->st_mtim.tv_nsec;
+}
+
 int file_read_whole(const char *path, char **data, size_t *len);
 int mkdir_recursive(char *path, mode_t mode);
 bool strends(const char *str, const char *suffix);
+double time_monotonic();
 
 #endif
@@ -0,0 +1,407 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <bsd/string.h>
+#include <libpng16/png.h>
+
+#include "log.h"
+#include "utils.h"
+
+#include "writer.h"
+
+// Limits of the run-length encoded tiles kept for the deduplication
+#define WRITER_MAX_RLE 4096
+#define WRITER_MAX_RETAINED (64 << 20)
+
+static int write_png(char *fname, int width, int height, uint8_t *img, rgba_t *colormap)
+{
+	// Written next to the tile and renamed over it, so that a failed write
+	// does not leave a truncated tile behind. This also replaces a hard link
+	// to the blank tile from an earlier run instead of writing through it.
+	char tmpname[PATH_MAX];
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+	FILE *fout = fopen(tmpname, "wb");
+	if (fout == NULL) {
+		log_error_errno("Failed to open %s", tmpname);
+		return -1;
+	}
+
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop png_info = png_ptr != NULL ? png_create_info_struct(png_ptr) : NULL;
+	// Allocated before the setjmp, so that the error path can free them
+	png_colorp colors = calloc(COLORMAP_LEN, sizeof(png_color));
+	png_bytep trns = calloc(COLORMAP_LEN, sizeof(png_byte));
+	png_bytep rowp = malloc(1 * width * sizeof(png_byte));
+	if (png_info == NULL || colors == NULL || trns == NULL || rowp == NULL) {
+		log_error("Failed to allocate the png structures");
+		goto fail;
+	}
+
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		log_error("Error during png creation");
+		goto fail;
+	}
+
+	png_init_io(png_ptr, fout);
+
+	for (unsigned i = 0; i < COLORMAP_LEN; i++) {
+		colors[i].red = colormap[i].r;
+		colors[i].green = colormap[i].g;
+		colors[i].blue = colormap[i].b;
+		trns[i] = colormap[i].a;
+	}
+
+	png_set_PLTE(png_ptr, png_info, colors, COLORMAP_LEN);
+	png_set_tRNS(png_ptr, png_info, trns, COLORMAP_LEN, NULL);
+	png_set_IHDR(png_ptr, png_info, width, height, 8, PNG_COLOR_TYPE_PALETTE,
+				 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+	png_write_info(png_ptr, png_info);
+
+	// TODO: We actually want pallete colors
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			rowp[x] = img[y * height + x];
+		}
+		png_write_row(png_ptr, rowp);
+	}
+
+	png_write_end(png_ptr, NULL);
+
+	png_destroy_write_struct(&png_ptr, &png_info);
+	free(colors);
+	free(trns);
+	free(rowp);
+	if (fclose(fout) || rename(tmpname, fname)) {
+		log_error_errno("Failed to write %s", fname);
+		unlink(tmpname);
+		return -1;
+	}
+	return 0;
+
+fail:
+	png_destroy_write_struct(&png_ptr, &png_info);
+	free(colors);
+	free(trns);
+	free(rowp);
+	fclose(fout);
+	unlink(tmpname);
+	return -1;
+}
+
+// Run-length encodes the tile as (count, value) byte pairs, returns NULL if
+// it does not fit into WRITER_MAX_RLE bytes
+static uint8_t *rle_encode(const uint8_t *tile, size_t n, size_t *len)
+{
+	uint8_t buf[WRITER_MAX_RLE];
+	size_t j = 0;
+	for (size_t i = 0; i < n; ) {
+		size_t run = 1;
+		while (i + run < n && run < UINT8_MAX && tile[i + run] == tile[i]) {
+			run++;
+		}
+		if (j + 2 > sizeof(buf)) {
+			return NULL;
+		}
+		buf[j++] = run;
+		buf[j++] = tile[i];
+		i += run;
+	}
+
+	uint8_t *rle = malloc(j);
+	if (rle == NULL) {
+		return NULL;
+	}
+	memcpy(rle, buf, j);
+	*len = j;
+	return rle;
+}
+
+static bool rle_equal(const uint8_t *rle, size_t len, const uint8_t *tile, size_t n)
+{
+	size_t i = 0;
+	for (size_t j = 0; j < len; j += 2) {
+		if (i + rle[j] > n) {
+			return false;
+		}
+		for (size_t k = 0; k < rle[j]; k++) {
+			if (tile[i + k] != rle[j + 1]) {
+				return false;
+			}
+		}
+		i += rle[j];
+	}
+	return i == n;
+}
+
+// Returns the entry of the hash, or the empty one it would go to. Called
+// with the lock held.
+static struct written_tile *written_slot(struct tile_writer *writer, uint64_t hash)
+{
+	size_t mask = writer->writtencap - 1;
+	for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+		struct written_tile *entry = &writer->written[i];
+		if (entry->hash == hash || entry->hash == 0) {
+			return entry;
+		}
+	}
+}
+
+// Remembers the path and the run-length encoded contents of a written tile,
+// replacing an earlier one with the same hash. Takes over the ownership of
+// rle. Called with the lock held.
+static void written_add(struct tile_writer *writer, uint64_t hash, const char *path,
+						uint8_t *rle, size_t rlelen)
+{
+	if (writer->retained + rlelen > WRITER_MAX_RETAINED) {
+		free(rle);
+		return;
+	}
+
+	// Kept at most half full
+	if (2 * (writer->nwritten + 1) > writer->writtencap) {
+		struct written_tile *old = writer->written;
+		size_t oldcap = writer->writtencap;
+		size_t cap = oldcap > 0 ? 2 * oldcap : 1024;
+		struct written_tile *written = calloc(cap, sizeof(written[0]));
+		if (written == NULL) {
+			free(rle);
+			return;
+		}
+		writer->written = written;
+		writer->writtencap = cap;
+		for (size_t i = 0; i < oldcap; i++) {
+			if (old[i].hash != 0) {
+				*written_slot(writer, old[i].hash) = old[i];
+			}
+		}
+		free(old);
+	}
+
+	char *copy = strdup(path);
+	if (copy == NULL) {
+		free(rle);
+		return;
+	}
+	struct written_tile *entry = written_slot(writer, hash);
+	if (entry->hash == 0) {
+		writer->nwritten++;
+	}
+	writer->retained += rlelen - entry->rlelen;
+	free(entry->path);
+	free(entry->rle);
+	entry->hash = hash;
+	entry->path = copy;
+	entry->rle = rle;
+	entry->rlelen = rlelen;
+}
+
+// Hard links the path to an identical tile written before, if there is one.
+// The contents are compared as well, so a hash collision only costs the
+// deduplication of the tile.
+static int link_written(struct tile_writer *writer, uint64_t hash, const uint8_t *tile,
+						char *path)
+{
+	char src[PATH_MAX];
+	size_t n = (size_t)writer->width * writer->height;
+	pthread_mutex_lock(&writer->lock);
+	struct written_tile *entry = writer->writtencap > 0 ? written_slot(writer, hash) : NULL;
+	bool found = entry != NULL && entry->hash != 0 &&
+		rle_equal(entry->rle, entry->rlelen, tile, n);
+	if (found) {
+		strlcpy(src, entry->path, sizeof(src));
+	}
+	pthread_mutex_unlock(&writer->lock);
+	if (!found) {
+		return -1;
+	}
+
+	unlink(path);
+	// Fails once the file has too many links, the tile then gets written and
+	// takes over as the one to link to
+	if (link(src, path)) {
+		return -1;
+	}
+	pthread_mutex_lock(&writer->lock);
+	writer->ndeduped++;
+	pthread_mutex_unlock(&writer->lock);
+	log_info(" linked %s to %s", path, src);
+	return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct tile_writer *writer = arg;
+
+	while (true) {
+		pthread_mutex_lock(&writer->lock);
+		while (writer->len == 0 && !writer->closed) {
+			pthread_cond_wait(&writer->notempty, &writer->lock);
+		}
+		if (writer->len == 0) {
+			// Closed and drained
+			pthread_mutex_unlock(&writer->lock);
+			return NULL;
+		}
+		struct writer_job job = writer->jobs[writer->head];
+		writer->head = (writer->head + 1) % writer->capacity;
+		writer->len--;
+		writer->busy++;
+		writer->ntiles++;
+		pthread_cond_signal(&writer->notfull);
+		pthread_mutex_unlock(&writer->lock);
+
+		size_t n = (size_t)writer->width * writer->height;
+		uint64_t hash = hash_bytes(HASH_INIT, job.tile, n);
+		hash = hash != 0 ? hash : 1;
+		// Tiles too detailed to keep a copy of are not deduplicated
+		size_t rlelen = 0;
+		uint8_t *rle = rle_encode(job.tile, n, &rlelen);
+		// Only fully written tiles get linked to, so two identical tiles
+		// encoded at the same time are both written out
+		int ret = 0;
+		if (rle == NULL || link_written(writer, hash, job.tile, job.path)) {
+			ret = write_png(job.path, writer->width, writer->height, job.tile,
+							writer->colormap);
+			if (ret == 0) {
+				if (rle != NULL) {
+					pthread_mutex_lock(&writer->lock);
+					written_add(writer, hash, job.path, rle, rlelen);
+					pthread_mutex_unlock(&writer->lock);
+					rle = NULL;
+				}
+				log_info(" wrote %s", job.path);
+			} else {
+				log_error("Failed to write the tile %s", job.path);
+			}
+		}
+		free(rle);
+		free(job.tile);
+
+		pthread_mutex_lock(&writer->lock);
+		if (ret != 0 && job.failed != NULL) {
+			__atomic_fetch_add(job.failed, 1, __ATOMIC_RELAXED);
+		}
+		writer->busy--;
+		if (writer->len == 0 && writer->busy == 0) {
+			pthread_cond_broadcast(&writer->idle);
+		}
+		pthread_mutex_unlock(&writer->lock);
+	}
+}
+
+int writer_start(struct tile_writer *writer, size_t nthreads,
+				 int width, int height, rgba_t *colormap)
+{
+	memset(writer, 0, sizeof(*writer));
+	writer->width = width;
+	writer->height = height;
+	writer->colormap = colormap;
+	// A couple of tiles per thread are enough to keep them all busy, without
+	// letting the renderer run too far ahead
+	writer->capacity = 2 * nthreads;
+	writer->jobs = calloc(writer->capacity, sizeof(writer->jobs[0]));
+	writer->threads = calloc(nthreads, sizeof(writer->threads[0]));
+	if (writer->jobs == NULL || writer->threads == NULL) {
+		log_error("Failed to allocate the tile writer");
+		free(writer->jobs);
+		free(writer->threads);
+		return -1;
+	}
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->notempty, NULL);
+	pthread_cond_init(&writer->notfull, NULL);
+	pthread_cond_init(&writer->idle, NULL);
+
+	for (; writer->nthreads < nthreads; writer->nthreads++) {
+		if (pthread_create(&writer->threads[writer->nthreads], NULL,
+						   writer_thread, writer)) {
+			log_error("Failed to start a tile writer thread");
+			writer_finish(writer);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Takes over the ownership of the (malloc-ed) tile. The failure count is
+// only safe to read after writer_flush.
+void writer_submit(struct tile_writer *writer, const char *path, uint8_t *tile, int *failed)
+{
+	pthread_mutex_lock(&writer->lock);
+	while (writer->len == writer->capacity) {
+		pthread_cond_wait(&writer->notfull, &writer->lock);
+	}
+	struct writer_job *job =
+		&writer->jobs[(writer->head + writer->len) % writer->capacity];
+	strlcpy(job->path, path, sizeof(job->path));
+	job->tile = tile;
+	job->failed = failed;
+	writer->len++;
+	pthread_cond_signal(&writer->notempty);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+// Waits until everything submitted so far is written out
+void writer_flush(struct tile_writer *writer)
+{
+	pthread_mutex_lock(&writer->lock);
+	while (writer->len > 0 || writer->busy > 0) {
+		pthread_cond_wait(&writer->idle, &writer->lock);
+	}
+	pthread_mutex_unlock(&writer->lock);
+}
+
+// Writes out everything still queued and stops the writer
+void writer_finish(struct tile_writer *writer)
+{
+	pthread_mutex_lock(&writer->lock);
+	writer->closed = true;
+	pthread_cond_broadcast(&writer->notempty);
+	pthread_mutex_unlock(&writer->lock);
+
+	for (size_t i = 0; i < writer->nthreads; i++) {
+		pthread_join(writer->threads[i], NULL);
+	}
+	if (writer->ntiles > 0) {
+		log_info("Deduplicated %zu of %zu tiles (%.1f%%)", writer->ndeduped, writer->ntiles,
+				 100.0 * writer->ndeduped / writer->ntiles);
+	}
+	for (size_t i = 0; i < writer->writtencap; i++) {
+		free(writer->written[i].path);
+		free(writer->written[i].rle);
+	}
+	free(writer->written);
+	pthread_cond_destroy(&writer->idle);
+	pthread_cond_destroy(&writer->notfull);
+	pthread_cond_destroy(&writer->notempty);
+	pthread_mutex_destroy(&writer->lock);
+	free(writer->threads);
+	free(writer->jobs);
+}
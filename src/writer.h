@@ -0,0 +1,91 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Josef Gajdusek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "colormaps.h"
+
+struct writer_job {
+	char path[PATH_MAX];
+	uint8_t *tile;
+	// Incremented if the tile could not be written, may be NULL
+	int *failed;
+};
+
+struct written_tile {
+	// Of the raw tile, 0 for unused entries
+	uint64_t hash;
+	char *path;
+	// Run-length encoded copy of the raw tile, to confirm a hash match
+	uint8_t *rle;
+	size_t rlelen;
+};
+
+// Encodes and writes out the rendered tiles on a pool of threads, so that
+// the renderer can carry on with the next tiles in the meantime. The queue
+// is bounded, writer_submit blocks while it is full.
+struct tile_writer {
+	int width;
+	int height;
+	rgba_t *colormap;
+	size_t nthreads;
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t notempty;
+	pthread_cond_t notfull;
+	// Ring buffer of the queued jobs
+	struct writer_job *jobs;
+	size_t capacity;
+	size_t head;
+	size_t len;
+	// Jobs taken off the queue, but not written yet
+	size_t busy;
+	pthread_cond_t idle;
+	bool closed;
+	// Hash table of the tiles written so far by their contents, identical
+	// tiles are hard linked to the first one instead of being encoded again.
+	// Only the tiles that run-length encode into a few kB are remembered,
+	// the others practically never repeat.
+	struct written_tile *written;
+	size_t writtencap;
+	size_t nwritten;
+	// Bytes of the run-length encoded copies
+	size_t retained;
+	size_t ntiles;
+	size_t ndeduped;
+};
+
+int writer_start(struct tile_writer *writer, size_t nthreads,
+				 int width, int height, rgba_t *colormap);
+void writer_submit(struct tile_writer *writer, const char *path, uint8_t *tile, int *failed);
+void writer_flush(struct tile_writer *writer);
+void writer_finish(struct tile_writer *writer);
+
+#endif